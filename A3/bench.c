@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "umem.h"
+
+/* Allocator benchmark
+Runs every umeminit strategy and the system malloc over the same seeded workloads.
+Each run gets a process of its own so the heap and the peak RSS start from scratch.
+
+    gcc -O2 bench.c umem.c -o bench -lpthread
+    ./bench [seed [ops]]
+*/
+
+#define REGION_SIZE (256 * 1024 * 1024)
+#define SLOTS       4096
+
+// One step of a workload: size 0 frees the slot, anything else allocates into it
+typedef struct op {
+    unsigned slot;
+    unsigned size;
+} op;
+
+typedef struct workload {
+    const char *name;
+    void (*generate)(op *ops, size_t n);
+} workload;
+
+typedef struct allocator {
+    const char *name;
+    int algorithm;
+} allocator;
+
+static unsigned long long rng_state;
+
+// xorshift64*, so the same seed gives the same workload on every machine
+static unsigned long long rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static unsigned rng_range(unsigned lo, unsigned hi) {
+    return lo + (unsigned)(rng() % (hi - lo + 1));
+}
+
+// Random allocs and frees over the slots with sizes spread evenly up to 4KB
+static void gen_uniform(op *ops, size_t n) {
+    char live[SLOTS] = {0};
+    for (size_t i = 0; i < n; i++) {
+        unsigned slot = (unsigned)(rng() % SLOTS);
+        ops[i].slot = slot;
+        ops[i].size = live[slot] ? 0 : rng_range(1, 4096);
+        live[slot] = !live[slot];
+    }
+}
+
+// Same pattern, but every size is a power of two from 8 bytes to 4KB
+static void gen_pow2(op *ops, size_t n) {
+    char live[SLOTS] = {0};
+    for (size_t i = 0; i < n; i++) {
+        unsigned slot = (unsigned)(rng() % SLOTS);
+        ops[i].slot = slot;
+        ops[i].size = live[slot] ? 0 : 1u << rng_range(3, 12);
+        live[slot] = !live[slot];
+    }
+}
+
+// A producer fills a queue in bursts and a consumer frees from the other end in order
+static void gen_prodcons(op *ops, size_t n) {
+    unsigned head = 0, tail = 0;
+    size_t i = 0;
+    while (i < n) {
+        unsigned burst = rng_range(1, 64);
+        for (unsigned k = 0; k < burst && i < n && head - tail < SLOTS; k++, i++) {
+            ops[i].slot = head++ % SLOTS;
+            ops[i].size = rng_range(16, 512);
+        }
+        burst = rng_range(1, 64);
+        for (unsigned k = 0; k < burst && i < n && tail < head; k++, i++) {
+            ops[i].slot = tail++ % SLOTS;
+            ops[i].size = 0;
+        }
+    }
+}
+
+// Mostly small objects that die within a few operations, with a few large
+// ones that live far longer and pin down the memory around them
+static void gen_lifetimes(op *ops, size_t n) {
+    char live[SLOTS] = {0};
+    unsigned short_slots = SLOTS / 8;
+    for (size_t i = 0; i < n; i++) {
+        unsigned slot;
+        if (rng() % 16 == 0) {
+            slot = short_slots + (unsigned)(rng() % (SLOTS - short_slots));
+            // Long-lived slots are only freed a quarter of the time they come up
+            if (live[slot] && rng() % 4 != 0) {
+                slot = (unsigned)(rng() % short_slots);
+            }
+        } else {
+            slot = (unsigned)(rng() % short_slots);
+        }
+        ops[i].slot = slot;
+        if (live[slot]) {
+            ops[i].size = 0;
+        } else {
+            ops[i].size = slot < short_slots ? rng_range(8, 256) : rng_range(1024, 16384);
+        }
+        live[slot] = !live[slot];
+    }
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a;
+    unsigned y = *(const unsigned *)b;
+    return (x > y) - (x < y);
+}
+
+static long peak_rss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+// Runs in a child process: builds the workload, times each operation and prints one row
+static void run(const workload *w, const allocator *al, unsigned long long seed, size_t n) {
+    op *ops = malloc(n * sizeof(op));
+    unsigned *ns = malloc(n * sizeof(unsigned));
+    void **slots = calloc(SLOTS, sizeof(void *));
+    if (!ops || !ns || !slots) {
+        perror("malloc");
+        exit(1);
+    }
+    rng_state = seed;
+    w->generate(ops, n);
+    memset(ns, 0, n * sizeof(unsigned));
+
+    int sys = al->algorithm == 0;
+    if (!sys && umeminit(REGION_SIZE, al->algorithm) != 0) {
+        fprintf(stderr, "umeminit failed for %s\n", al->name);
+        exit(1);
+    }
+    long rss_before = peak_rss_kb();
+
+    size_t failures = 0;
+    long total = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned slot = ops[i].slot;
+        long start = now_ns();
+        if (ops[i].size == 0) {
+            if (sys) {
+                free(slots[slot]);
+            } else {
+                ufree(slots[slot]);
+            }
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = sys ? malloc(ops[i].size) : umalloc(ops[i].size);
+            if (slots[slot]) {
+                // Touch the block the way a caller would
+                *(char *)slots[slot] = 1;
+            } else {
+                failures++;
+            }
+        }
+        long took = now_ns() - start;
+        ns[i] = (unsigned)took;
+        total += took;
+    }
+
+    // Fragmentation is measured with whatever the workload left live
+    char frag[16] = "-";
+    if (!sys) {
+        umem_stats stats;
+        umemstats(&stats);
+        snprintf(frag, sizeof(frag), "%.3f", stats.fragmentation);
+    }
+    long rss = peak_rss_kb() - rss_before;
+
+    qsort(ns, n, sizeof(unsigned), compare_ns);
+    printf("%-10s %-10s %8.2f %6u %6u %6u %7u %8ld %6s %6zu\n", w->name, al->name,
+           total ? n * 1000.0 / total : 0.0,
+           ns[n / 2], ns[n * 90 / 100], ns[n * 99 / 100], ns[n * 999 / 1000], rss, frag, failures);
+    fflush(stdout);
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 42;
+    size_t n = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000;
+    if (seed == 0 || n == 0) {
+        fprintf(stderr, "usage: %s [seed [ops]] (seed and ops must be non-zero)\n", argv[0]);
+        return 1;
+    }
+
+    workload workloads[] = {
+        {"uniform", gen_uniform},
+        {"pow2", gen_pow2},
+        {"prodcons", gen_prodcons},
+        {"lifetimes", gen_lifetimes},
+    };
+    allocator allocators[] = {
+        {"BEST_FIT", BEST_FIT},
+        {"WORST_FIT", WORST_FIT},
+        {"FIRST_FIT", FIRST_FIT},
+        {"NEXT_FIT", NEXT_FIT},
+        {"BUDDY", BUDDY},
+        {"SLAB", SLAB},
+        {"malloc", 0},
+    };
+    int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+    int num_allocators = sizeof(allocators) / sizeof(allocators[0]);
+
+    printf("seed %llu, %zu operations per run, latencies in ns\n\n", seed, n);
+    printf("%-10s %-10s %8s %6s %6s %6s %7s %8s %6s %6s\n", "workload", "allocator",
+           "Mops/s", "p50", "p90", "p99", "p99.9", "rss(KB)", "frag", "fails");
+
+    for (int w = 0; w < num_workloads; w++) {
+        for (int a = 0; a < num_allocators; a++) {
+            // Anything still buffered would be printed again by the child
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0) {
+                run(&workloads[w], &allocators[a], seed, n);
+            }
+            int status;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                printf("%-10s %-10s failed\n", workloads[w].name, allocators[a].name);
+            }
+        }
+        printf("\n");
+    }
+    return 0;
+}
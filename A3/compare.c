@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Preload comparison
+Runs real programs with the system malloc and then with libumem.so preloaded under each
+strategy, and reports wall time and peak RSS. Every run is a fresh process; wait4 gives the
+peak RSS of the process and of every child it waited for, so a compiler driver counts its
+compiler proper too. Output of the workloads goes to /dev/null.
+
+    gcc -O2 -fPIC -shared -ftls-model=initial-exec preload.c umem.c -o libumem.so -lpthread
+    gcc -O2 compare.c -o compare
+    ./compare ./libumem.so [strategy ...] [-- command [args]]
+
+Without a command it runs the built-in workloads below. The inspect workload expects
+../A4/inspect3 to have been built from inspect3.c.
+*/
+
+#define RUNS 3
+
+typedef struct workload {
+    const char *name;
+    char *const *argv;
+} workload;
+
+typedef struct result {
+    long wall_us;
+    long rss_kb;
+    int status;
+} result;
+
+static char *const inspect_argv[] = {"../A4/inspect3", "-a", "-r", "-j", "4", "/usr", NULL};
+static char *const compile_argv[] = {"cc", "-O2", "-c", "umem.c", "-o", "/dev/null", NULL};
+
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Runs argv once; library NULL means the system malloc
+static result run(char *const *argv, const char *library, const char *strategy) {
+    result r = {0, 0, -1};
+    long start = now_us();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return r;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        if (library) {
+            setenv("LD_PRELOAD", library, 1);
+            setenv("UMEM_STRATEGY", strategy, 1);
+        } else {
+            unsetenv("LD_PRELOAD");
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        return r;
+    }
+    r.wall_us = now_us() - start;
+    r.rss_kb = ru.ru_maxrss;
+    r.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return r;
+}
+
+// The fastest of RUNS runs, so a cold page cache only costs the first one
+static result best_of(char *const *argv, const char *library, const char *strategy) {
+    result best = run(argv, library, strategy);
+    for (int i = 1; i < RUNS && best.status == 0; i++) {
+        result r = run(argv, library, strategy);
+        if (r.status != 0 || r.wall_us < best.wall_us) {
+            best = r;
+        }
+    }
+    return best;
+}
+
+static void print_row(const char *workload, const char *allocator, result r, result base) {
+    if (r.status != 0) {
+        printf("%-10s %-18s failed with status %d\n", workload, allocator, r.status);
+        return;
+    }
+    printf("%-10s %-18s %10.1f %10ld", workload, allocator, r.wall_us / 1000.0, r.rss_kb);
+    if (base.status == 0 && base.wall_us && base.rss_kb) {
+        printf(" %7.2fx %7.2fx", (double)r.wall_us / base.wall_us, (double)r.rss_kb / base.rss_kb);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s libumem.so [strategy ...] [-- command [args]]\n", argv[0]);
+        return 1;
+    }
+    // LD_PRELOAD has to name the library the same way from wherever the workload runs
+    char library[PATH_MAX];
+    if (!realpath(argv[1], library)) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    const char *defaults[] = {"BEST_FIT", "WORST_FIT", "FIRST_FIT", "NEXT_FIT", "BUDDY", "SLAB"};
+    const char **strategies = defaults;
+    int num_strategies = 6;
+    int first = 2;
+    while (first < argc && strcmp(argv[first], "--") != 0) {
+        first++;
+    }
+    if (first > 2) {
+        strategies = (const char **)argv + 2;
+        num_strategies = first - 2;
+    }
+
+    workload workloads[] = {
+        {"inspect", inspect_argv},
+        {"compile", compile_argv},
+    };
+    int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+    if (first + 1 < argc) {
+        workloads[0].name = "command";
+        workloads[0].argv = argv + first + 1;
+        num_workloads = 1;
+    }
+
+    printf("best of %d runs, times relative to the system malloc\n\n", RUNS);
+    printf("%-10s %-18s %10s %10s %8s %8s\n", "workload", "allocator", "wall(ms)", "rss(KB)", "time", "rss");
+    for (int w = 0; w < num_workloads; w++) {
+        // Anything still buffered would be printed again by the child
+        fflush(stdout);
+        result base = best_of(workloads[w].argv, NULL, NULL);
+        print_row(workloads[w].name, "malloc", base, base);
+        for (int s = 0; s < num_strategies; s++) {
+            fflush(stdout);
+            print_row(workloads[w].name, strategies[s], best_of(workloads[w].argv, library, strategies[s]), base);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -2,8 +2,19 @@
 #include <assert.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <errno.h>
+#include <stddef.h>
 
 #include "umem.h"
+#include "trace.h"
 
 //Test Function Delcarations 
 void allocateBlocks(void *ptrs[10]);
@@ -13,9 +24,31 @@ void testZeroAllocation();
 void alignmentTest();
 void worstFitTest();
 void memStateTest(int i);
+void arenaResetTest();
+void slabTest();
+void statsTest();
+void reallocTest();
+void batchTest();
+void checkTest();
+void traceTest();
+void threadStatsTest();
+void crossFreeTest();
+void growTest();
+void largeTest();
+void numaTest();
+void numaRun();
+void numaNoMbindTest();
+void buddyTest();
+int inChild(void (*test)());
 
 
 int main() {
+    // These set up a global heap of their own, so they run in children forked before ours exists
+    assert(inChild(threadStatsTest) == 0);
+    assert(inChild(crossFreeTest) == 0);
+    assert(inChild(numaTest) == 0);
+    assert(inChild(numaNoMbindTest) == 0);
+
     printf("Initializing memory allocator with 1MB using BEST_FIT\n");
     umeminit(1024 * 1024, BEST_FIT);
     
@@ -30,6 +63,16 @@ int main() {
     testZeroAllocation();
     worstFitTest();
     alignmentTest();
+    arenaResetTest();
+    slabTest();
+    statsTest();
+    reallocTest();
+    batchTest();
+    checkTest();
+    traceTest();
+    growTest();
+    largeTest();
+    buddyTest();
     
     return 0;
 }
@@ -127,33 +170,44 @@ void testZeroAllocation(){
 /* Test Case 6:
 This test case is to allow worst fit testng as display the allocation strategy that is used as well.
 This is also good at showing how the largest avaliable block is taken first.
+It runs in its own arena so the BEST_FIT heap from main is left alone.
 */
 void worstFitTest(){
     printf("\nTest Case: 6: Testing WORST_FIT allocation\n");
     void *ptrs[6];
-    umeminit(1024 * 1024, WORST_FIT);
-    ptrs[0] = umalloc(1024);
-    ptrs[1] = umalloc(4096);
-    ptrs[2] = umalloc(32);
-    ptrs[3] = umalloc(8192);
-    ptrs[4] = umalloc(16384);
-    ptrs[5] = umalloc(16);
-    umemdump();
+    umem_arena *arena = umem_arena_create(1024 * 1024, WORST_FIT);
+    assert(arena != NULL);
+    ptrs[0] = arena_malloc(arena, 1024);
+    ptrs[1] = arena_malloc(arena, 4096);
+    ptrs[2] = arena_malloc(arena, 32);
+    ptrs[3] = arena_malloc(arena, 8192);
+    ptrs[4] = arena_malloc(arena, 16384);
+    ptrs[5] = arena_malloc(arena, 16);
+    // Each allocation carves the front of the one big free block, so addresses only grow
+    for (int i = 1; i < 6; i++) {
+        assert(ptrs[i] > ptrs[i - 1]);
+    }
+    arena_dump(arena);
+    umem_arena_destroy(arena);
 }
 
 /* Test Case 7:
 This function is used to verify that the system corretly allocates blocks to various boundaries
-The range of boundaries that I use are from 8 to 32 byte 
-this test can only be ran with allocateBlocks or by itself.
+The range of boundaries that I use are from 8 bytes up to a whole 4096 byte page.
+The first pass runs on the main heap with umemalign, the second repeats it for every
+strategy in an arena of its own so each allocation policy is checked.
 */
 void alignmentTest() {
     printf("\nTest Case 7: Testing Multiple Alignments\n");
 
     // Test alignments and sizes
     int test_sizes[] = {1, 16, 32, 64, 128, 256, 512, 1024, 2048};
-    size_t alignments[] = {8, 16, 32};
+    size_t alignments[] = {8, 16, 32, 64, 4096};
+    int algorithms[] = {BEST_FIT, WORST_FIT, FIRST_FIT, NEXT_FIT, BUDDY};
+    const char *names[] = {"BEST_FIT", "WORST_FIT", "FIRST_FIT", "NEXT_FIT", "BUDDY"};
     int num_sizes = sizeof(test_sizes) / sizeof(test_sizes[0]);
     int num_alignments = sizeof(alignments) / sizeof(alignments[0]);
+    int num_algorithms = sizeof(algorithms) / sizeof(algorithms[0]);
 
     srand(time(NULL));
 
@@ -162,17 +216,617 @@ void alignmentTest() {
             size_t size = test_sizes[i];
             size_t alignment = alignments[j];
 
-            void *ptr = umalloc(size);
+            void *ptr = umemalign(alignment, size);
             size_t address = (size_t)ptr;
 
             printf("Testing allocation size %zu bytes for %zu-byte alignment: ", size, alignment);
             // THis is for checking the alignment to make sure everything is okay.
-            //assert(address % alignment == 0); 
+            assert(ptr != NULL);
+            assert(address % alignment == 0); 
             printf("Pass\n");
 
             ufree(ptr);
         }
     }
 
+    for (int k = 0; k < num_algorithms; k++) {
+        umem_arena *arena = umem_arena_create(1024 * 1024, algorithms[k]);
+        assert(arena != NULL);
+        for (int i = 0; i < num_sizes; i++) {
+            for (int j = 0; j < num_alignments; j++) {
+                void *ptr = arena_memalign(arena, alignments[j], test_sizes[i]);
+                assert(ptr != NULL);
+                assert((size_t)ptr % alignments[j] == 0);
+                // Touch the whole payload so overlapping blocks would show up
+                memset(ptr, 0xAB, test_sizes[i]);
+                assert(arena_free(arena, ptr) == 0);
+            }
+        }
+        printf("%s: all alignments passed\n", names[k]);
+        umem_arena_destroy(arena);
+    }
+
     printf("All alignment tests passed.\n\n");
-}
\ No newline at end of file
+}
+
+/* Test Case 8:
+This test fills an arena with small blocks and then resets it in one call.
+After the reset the whole region should be a single free block again, so the
+next allocation starts back at the first address.
+*/
+void arenaResetTest() {
+    printf("Test Case 8: Resetting an arena\n");
+    umem_arena *arena = umem_arena_create(64 * 1024, FIRST_FIT);
+    assert(arena != NULL);
+
+    void *first = arena_malloc(arena, 64);
+    int count = 1;
+    while (arena_malloc(arena, 64) != NULL) {
+        count++;
+    }
+    printf("Allocated %d blocks of 64 bytes before the arena filled up\n", count);
+
+    arena_reset(arena);
+    void *again = arena_malloc(arena, 64);
+    assert(again == first);
+    printf("Arena reset returned all %d blocks, next allocation reuses %p\n\n", count, again);
+    umem_arena_destroy(arena);
+}
+
+/* Test Case 9:
+This test allocates a run of 16 byte objects from a SLAB arena.
+Slab objects have no header, so neighbours from the same slab should sit exactly 16 bytes apart
+and freeing them all should let the same slots be handed out again.
+*/
+void slabTest() {
+    printf("Test Case 9: Slab allocation of fixed size objects\n");
+    umem_arena *arena = umem_arena_create(1024 * 1024, SLAB);
+    assert(arena != NULL);
+
+    void *objs[100];
+    for (int i = 0; i < 100; i++) {
+        objs[i] = arena_malloc(arena, 16);
+        assert(objs[i] != NULL);
+        if (i > 0) {
+            assert((char *)objs[i] - (char *)objs[i - 1] == 16);
+        }
+    }
+    printf("100 objects of 16 bytes took %td bytes\n", (char *)objs[99] + 16 - (char *)objs[0]);
+
+    for (int i = 0; i < 100; i++) {
+        assert(arena_free(arena, objs[i]) == 0);
+    }
+    void *again = arena_malloc(arena, 16);
+    assert(again == objs[99]);
+    printf("Freed slots are reused, most recent first\n\n");
+    umem_arena_destroy(arena);
+}
+/* Test Case 10:
+This test checks the allocator statistics on a small FIRST_FIT arena.
+Freeing the middle of three blocks leaves a hole the tail can't merge with, so the
+free memory is split in two and fragmentation shows up. Freeing the rest brings it back to one block.
+A debug build gives the same numbers, since its quarantine only samples later frees.
+*/
+void statsTest() {
+    printf("Test Case 10: Allocator statistics\n");
+    umem_arena *arena = umem_arena_create(64 * 1024, FIRST_FIT);
+    assert(arena != NULL);
+
+    void *ptrs[3];
+    for (int i = 0; i < 3; i++) {
+        ptrs[i] = arena_malloc(arena, 1024);
+    }
+    arena_free(arena, ptrs[1]);
+
+    umem_stats stats;
+    assert(arena_stats(arena, &stats) == 0);
+    assert(stats.allocs == 3 && stats.frees == 1);
+    assert(stats.in_use + stats.free_bytes == 64 * 1024);
+    assert(stats.fragmentation > 0);
+    arena_stats_json(arena, stdout);
+
+    arena_free(arena, ptrs[0]);
+    arena_free(arena, ptrs[2]);
+    assert(arena_stats(arena, &stats) == 0);
+    assert(stats.in_use == 0 && stats.peak_in_use >= 3 * 1024);
+    assert(stats.coalesces >= 2 && stats.fragmentation == 0);
+    arena_stats_json(arena, stdout);
+#ifdef UMEM_DEBUG
+    // The debug quarantine holds back every sixteenth free of an arena, so after
+    // sixteen more one block is still in use, though its free is already counted
+    for (int i = 0; i < 16; i++) {
+        arena_free(arena, arena_malloc(arena, 64));
+    }
+    assert(arena_stats(arena, &stats) == 0);
+    assert(stats.allocs == 19 && stats.frees == 19 && stats.in_use > 0);
+#endif
+    printf("\n");
+    umem_arena_destroy(arena);
+}
+
+/* Test Case 11:
+This test grows and shrinks a block with arena_realloc in a FIRST_FIT arena.
+The block after it is freed first, so growing should absorb it and keep the same address,
+and the contents written before the resize should still be there. arena_calloc must return zeroed memory.
+*/
+void reallocTest() {
+    printf("Test Case 11: Resizing blocks in place\n");
+    umem_arena *arena = umem_arena_create(64 * 1024, FIRST_FIT);
+    assert(arena != NULL);
+
+    char *a = arena_malloc(arena, 100);
+    char *b = arena_malloc(arena, 100);
+    char *c = arena_malloc(arena, 100);
+    memset(a, 'x', 100);
+    arena_free(arena, b);
+
+    char *grown = arena_realloc(arena, a, 200);
+    assert(grown == a && grown[99] == 'x');
+    char *shrunk = arena_realloc(arena, grown, 50);
+    assert(shrunk == a && shrunk[49] == 'x');
+    printf("Grew to 200 bytes and shrank to 50 without moving from %p\n", (void *)a);
+
+    int *zeros = arena_calloc(arena, 256, sizeof(int));
+    assert(zeros != NULL);
+    for (int i = 0; i < 256; i++) {
+        assert(zeros[i] == 0);
+    }
+    printf("arena_calloc returned 256 zeroed ints\n\n");
+    arena_free(arena, c);
+    umem_arena_destroy(arena);
+}
+
+/* Test Case 12:
+This test allocates 100 blocks with one arena_malloc_batch call and frees them with one arena_free_batch.
+The blocks are cut back to back from the same free block, so they should be evenly spaced.
+The free list is shuffled first; sorting inside the batch free should still merge everything back into one free block.
+Then a UMEM_GROW arena is filled to the brim with 1000 byte blocks and every other one is freed. A batch of 64
+fits in the holes that leaves, so it should be served from them without mapping another chunk.
+*/
+void batchTest() {
+    printf("Test Case 12: Batch allocation and free\n");
+    umem_arena *arena = umem_arena_create(64 * 1024, BEST_FIT);
+    assert(arena != NULL);
+
+    void *ptrs[100];
+    size_t got = arena_malloc_batch(arena, 48, 100, ptrs);
+    assert(got == 100);
+    for (int i = 1; i < 100; i++) {
+        assert((char *)ptrs[i] - (char *)ptrs[i - 1] == (char *)ptrs[1] - (char *)ptrs[0]);
+    }
+    printf("Allocated %zu blocks %td bytes apart\n", got, (char *)ptrs[1] - (char *)ptrs[0]);
+
+    for (int i = 99; i > 0; i--) {
+        int j = rand() % (i + 1);
+        void *tmp = ptrs[i];
+        ptrs[i] = ptrs[j];
+        ptrs[j] = tmp;
+    }
+    assert(arena_free_batch(arena, ptrs, 100) == 0);
+
+    umem_stats stats;
+    arena_stats(arena, &stats);
+    assert(stats.in_use == 0 && stats.largest_free == stats.free_bytes);
+    printf("Batch free left one free block of %zu bytes\n", stats.largest_free);
+    umem_arena_destroy(arena);
+
+    arena = umem_arena_create(1024 * 1024, BEST_FIT | UMEM_GROW);
+    assert(arena != NULL);
+    arena_set_trim_threshold(arena, 0);
+    umem_stats before;
+    assert(arena_stats(arena, &before) == 0);
+    static void *full[2048];
+    int count = 0;
+    do {
+        full[count] = arena_malloc(arena, 1000);
+        assert(full[count++] != NULL && count < 2048);
+        assert(arena_stats(arena, &stats) == 0);
+    } while (stats.mapped == before.mapped);
+    // The block that needed a chunk goes back, and with it the chunk
+    assert(arena_free_batch(arena, &full[--count], 1) == 0);
+    void *holes[1024];
+    int freed = 0;
+    for (int i = 0; i < count; i += 2) {
+        holes[freed++] = full[i];
+    }
+    assert(arena_free_batch(arena, holes, freed) == 0);
+    assert(arena_stats(arena, &stats) == 0);
+    assert(stats.mapped == before.mapped && stats.largest_free < 64 * 1000);
+
+    void *batch[64];
+    assert(arena_malloc_batch(arena, 1000, 64, batch) == 64);
+    assert(arena_stats(arena, &stats) == 0);
+    assert(stats.mapped == before.mapped && arena_check(arena) == 0);
+    printf("A batch of 64 went into the holes of %d freed blocks without mapping more\n\n", freed);
+    umem_arena_destroy(arena);
+}
+
+/* Test Case 13:
+This test runs the heap consistency check on a FIRST_FIT arena after a few allocations and a free.
+Writing past the end of the first block clobbers the header of the free block behind it,
+which the check should report instead of letting the next allocation walk into it.
+*/
+void checkTest() {
+    printf("Test Case 13: Heap consistency check\n");
+    umem_arena *arena = umem_arena_create(64 * 1024, FIRST_FIT);
+    assert(arena != NULL);
+
+    char *a = arena_malloc(arena, 100);
+    char *b = arena_malloc(arena, 100);
+    char *c = arena_malloc(arena, 100);
+    arena_free(arena, b);
+    assert(arena_check(arena) == 0);
+    printf("Heap is consistent after three allocations and a free\n");
+
+    memset(a, 0, c - a);
+    assert(arena_check(arena) == -1);
+    printf("Overrunning the first block was caught\n\n");
+    umem_arena_destroy(arena);
+}
+
+/* Test Case 14:
+This test records a short trace of the global heap and reads it back with trace_read, the
+decoder replay uses. Every call should come back in order with the pointer, size, alignment
+and old pointer it was made with, and the times should never go backwards.
+*/
+void traceTest() {
+    printf("Test Case 14: Trace round trip\n");
+    char path[] = "/tmp/umemtraceXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    assert(umem_trace_start(path) == 0);
+
+    trace_record want[7];
+    char *a = umalloc(100);
+    want[0] = (trace_record){TRACE_ALLOC, (size_t)a, 100, 0, 0, 0};
+    char *b = ucalloc(10, 8);
+    want[1] = (trace_record){TRACE_CALLOC, (size_t)b, 80, 0, 0, 0};
+    char *c = umemalign(64, 200);
+    want[2] = (trace_record){TRACE_MEMALIGN, (size_t)c, 200, 64, 0, 0};
+    char *grown = urealloc(a, 3000);
+    want[3] = (trace_record){TRACE_REALLOC, (size_t)grown, 3000, 0, (size_t)a, 0};
+    ufree(b);
+    want[4] = (trace_record){TRACE_FREE, (size_t)b, 0, 0, 0, 0};
+    ufree(c);
+    want[5] = (trace_record){TRACE_FREE, (size_t)c, 0, 0, 0, 0};
+    ufree(grown);
+    want[6] = (trace_record){TRACE_FREE, (size_t)grown, 0, 0, 0, 0};
+    assert(umem_trace_stop() == 0);
+
+    unsigned char buf[512];
+    FILE *f = fopen(path, "rb");
+    assert(f != NULL);
+    size_t len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    unlink(path);
+    assert(len > TRACE_MAGIC_LEN && memcmp(buf, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0);
+
+    const unsigned char *p = buf + TRACE_MAGIC_LEN;
+    trace_record got = {0, 0, 0, 0, 0, 0};
+    long long last = 0;
+    for (int i = 0; i < 7; i++) {
+        p = trace_read(p, buf + len, &got);
+        assert(p != NULL);
+        assert(got.op == want[i].op && got.ptr == want[i].ptr && got.size == want[i].size);
+        assert(got.alignment == want[i].alignment && got.old == want[i].old);
+        assert(got.time_ns >= last);
+        last = got.time_ns;
+    }
+    assert(p == buf + len);
+    printf("Seven calls came back from %zu bytes of trace\n\n", len);
+}
+
+/* umeminit only works once, so tests that need a global heap set up differently
+run in a child process, forked before main sets up its own, and report through its exit status.
+*/
+int inChild(void (*test)()) {
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        test();
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+#define STAT_THREADS 4
+#define STAT_BLOCKS  2000
+#define STAT_KEPT    500
+
+// Allocates STAT_BLOCKS blocks, some too big for the thread cache, and keeps the first STAT_KEPT
+void *statsWorker(void *arg) {
+    void **kept = arg;
+    unsigned seed = (unsigned)(size_t)arg;
+    void *ptrs[STAT_BLOCKS];
+    for (int i = 0; i < STAT_BLOCKS; i++) {
+        ptrs[i] = umalloc(rand_r(&seed) % 800 + 1);
+        assert(ptrs[i] != NULL);
+    }
+    for (int i = 0; i < STAT_BLOCKS; i++) {
+        if (i < STAT_KEPT) {
+            kept[i] = ptrs[i];
+        } else {
+            ufree(ptrs[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Test Case 15:
+This test runs four threads on a UMEM_THREADED global heap, so most calls are served by
+the thread caches and the rest by the arena. Each call has to be counted once, at one
+of the two: allocs - frees must equal the blocks still live. The kept blocks are freed
+after their threads have exited, which sends them to the arena instead of a cache.
+*/
+void threadStatsTest() {
+    printf("Test Case 15: Statistics of a threaded heap\n");
+    assert(umeminit(4 * 1024 * 1024, BEST_FIT | UMEM_THREADED) == 0);
+
+    static void *kept[STAT_THREADS][STAT_KEPT];
+    pthread_t threads[STAT_THREADS];
+    for (int i = 0; i < STAT_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, statsWorker, kept[i]) == 0);
+    }
+    for (int i = 0; i < STAT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    umem_stats stats;
+    assert(umemstats(&stats) == 0);
+    assert(stats.allocs == STAT_THREADS * STAT_BLOCKS);
+    assert(stats.allocs - stats.frees == STAT_THREADS * STAT_KEPT);
+    printf("%zu allocs and %zu frees leave %d blocks live\n", stats.allocs, stats.frees, STAT_THREADS * STAT_KEPT);
+
+    for (int i = 0; i < STAT_THREADS; i++) {
+        for (int j = 0; j < STAT_KEPT; j++) {
+            ufree(kept[i][j]);
+        }
+    }
+    assert(umemstats(&stats) == 0);
+    assert(stats.allocs == stats.frees && umem_check() == 0);
+    printf("Freeing the rest from the main thread balances them at %zu\n\n", stats.frees);
+}
+
+#define CROSS_THREADS 4
+#define CROSS_BLOCKS  1000
+#define CROSS_ROUNDS  20
+
+static void *crossBlocks[CROSS_THREADS][CROSS_BLOCKS];
+static pthread_barrier_t crossBarrier;
+
+// Each round fills this thread's row, then frees the row of the thread after it
+void *crossWorker(void *arg) {
+    int me = (int)(size_t)arg;
+    int next = (me + 1) % CROSS_THREADS;
+    unsigned seed = me + 1;
+    for (int round = 0; round < CROSS_ROUNDS; round++) {
+        for (int i = 0; i < CROSS_BLOCKS; i++) {
+            size_t size = rand_r(&seed) % 300 + 1;
+            crossBlocks[me][i] = umalloc(size);
+            assert(crossBlocks[me][i] != NULL);
+            memset(crossBlocks[me][i], me, size);
+        }
+        pthread_barrier_wait(&crossBarrier);
+        for (int i = 0; i < CROSS_BLOCKS; i++) {
+            assert(*(unsigned char *)crossBlocks[next][i] == next);
+            ufree(crossBlocks[next][i]);
+        }
+        pthread_barrier_wait(&crossBarrier);
+    }
+    return NULL;
+}
+
+/* Test Case 16:
+This test frees every block from a thread other than the one that allocated it, on a
+UMEM_THREADED global heap. The blocks go back through the owners' remote stacks and are
+picked up on their next refill, so after twenty rounds the heap must still check out,
+every block must be counted as freed and, once the threads are gone, none left in use.
+*/
+void crossFreeTest() {
+    printf("Test Case 16: Freeing blocks across threads\n");
+    assert(umeminit(4 * 1024 * 1024, FIRST_FIT | UMEM_THREADED) == 0);
+    pthread_barrier_init(&crossBarrier, NULL, CROSS_THREADS);
+
+    pthread_t threads[CROSS_THREADS];
+    for (int i = 0; i < CROSS_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, crossWorker, (void *)(size_t)i) == 0);
+    }
+    for (int i = 0; i < CROSS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&crossBarrier);
+    assert(umem_check() == 0);
+
+    umem_stats stats;
+    assert(umemstats(&stats) == 0);
+    assert(stats.allocs == CROSS_THREADS * CROSS_BLOCKS * CROSS_ROUNDS);
+    assert(stats.frees == stats.allocs);
+#ifndef UMEM_DEBUG
+    // A debug build still holds the last few sampled frees in its quarantine
+    assert(stats.in_use == 0);
+#endif
+    printf("%zu blocks freed across threads, heap consistent\n\n", stats.frees);
+}
+
+/* Test Case 17:
+This test fills a 64KB UMEM_GROW arena four times over, so it has to map extra chunks,
+then frees everything in one batch, which skips the debug quarantine. With no trim
+threshold every extra chunk should be unmapped as soon as it is empty, and the original
+region should be one free block as large as it was to begin with.
+*/
+void growTest() {
+    printf("Test Case 17: Growing and trimming an arena\n");
+    umem_arena *arena = umem_arena_create(64 * 1024, FIRST_FIT | UMEM_GROW);
+    assert(arena != NULL);
+    arena_set_trim_threshold(arena, 0);
+
+    umem_stats before;
+    assert(arena_stats(arena, &before) == 0);
+    void *ptrs[256];
+    for (int i = 0; i < 256; i++) {
+        ptrs[i] = arena_malloc(arena, 1000);
+        assert(ptrs[i] != NULL);
+    }
+    umem_stats grown;
+    assert(arena_stats(arena, &grown) == 0);
+    assert(grown.mapped > before.mapped && arena_check(arena) == 0);
+    printf("256 blocks of 1000 bytes grew the arena from %zu to %zu mapped bytes\n", before.mapped, grown.mapped);
+
+    assert(arena_free_batch(arena, ptrs, 256) == 0);
+    umem_stats after;
+    assert(arena_stats(arena, &after) == 0);
+    assert(after.in_use == 0 && after.mapped == before.mapped);
+    assert(after.largest_free == before.largest_free && after.free_bytes == before.free_bytes);
+    assert(arena_check(arena) == 0);
+    printf("Freeing them trimmed it back to %zu, with a %zu byte free block\n\n", after.mapped, after.largest_free);
+    umem_arena_destroy(arena);
+}
+
+/* Test Case 18:
+This test moves a block across the mmap threshold of a UMEM_HUGEPAGES arena and back.
+With a neighbour in the way, growing 100 bytes to 300KB has to move the block into a
+mapping of its own with its contents, and the whole new size must be writable. A 3MB block is big enough for a huge page mapping,
+explicit or a 2MB aligned fallback, so its payload starts just past a 2MB boundary.
+Shrinking keeps the mapping, and freeing both unmaps everything again.
+*/
+void largeTest() {
+    printf("Test Case 18: Large objects and huge pages\n");
+    umem_arena *arena = umem_arena_create(1024 * 1024, BEST_FIT | UMEM_HUGEPAGES);
+    assert(arena != NULL);
+    arena_set_mmap_threshold(arena, 256 * 1024);
+    umem_stats before, stats;
+    assert(arena_stats(arena, &before) == 0);
+
+    char *a = arena_malloc(arena, 100);
+    char *neighbour = arena_malloc(arena, 100);
+    memset(a, 'a', 100);
+    char *moved = arena_realloc(arena, a, 300 * 1024);
+    assert(moved != NULL && moved[0] == 'a' && moved[99] == 'a');
+    memset(moved, 'm', 300 * 1024);
+    assert(arena_stats(arena, &stats) == 0);
+    assert(stats.mapped >= before.mapped + 300 * 1024);
+    printf("Growing 100 bytes to 300KB moved the block into its own mapping\n");
+
+    char *huge = arena_malloc(arena, 3 * 1024 * 1024);
+    assert(huge != NULL && (size_t)huge % (2 * 1024 * 1024) < 4096);
+    memset(huge, 'h', 3 * 1024 * 1024);
+    char *shrunk = arena_realloc(arena, huge, 1000);
+    assert(shrunk == huge && shrunk[999] == 'h');
+    shrunk = arena_realloc(arena, moved, 1000);
+    assert(shrunk == moved && shrunk[999] == 'm');
+    printf("A 3MB block started %zu bytes past a 2MB boundary and both shrank in place\n", (size_t)huge % (2 * 1024 * 1024));
+
+    arena_free(arena, moved);
+    arena_free(arena, huge);
+    arena_free(arena, neighbour);
+    assert(arena_stats(arena, &stats) == 0);
+    assert(stats.in_use == 0 && stats.mapped == before.mapped && arena_check(arena) == 0);
+    printf("Freeing them unmapped both\n\n");
+    umem_arena_destroy(arena);
+}
+
+void *numaWorker(void *arg) {
+    (void)arg;
+    void *ptrs[500];
+    for (int i = 0; i < 500; i++) {
+        ptrs[i] = umalloc(i % 200 + 1);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], i, i % 200 + 1);
+    }
+    for (int i = 0; i < 500; i++) {
+        ufree(ptrs[i]);
+    }
+    return NULL;
+}
+
+/* Test Case 19:
+This test sets up a UMEM_NUMA global heap and runs four threads on it, wherever the scheduler
+puts them. On a single node it is just the ordinary heap. Either way init has to succeed,
+every node heap has to check out and the calls have to balance.
+*/
+void numaTest() {
+    printf("Test Case 19: NUMA node heaps\n");
+    numaRun();
+}
+
+// Shared by Test Cases 19 and 20
+void numaRun() {
+    assert(umeminit(4 * 1024 * 1024, BEST_FIT | UMEM_NUMA) == 0);
+    assert(umem_numa_nodes() >= 1);
+
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&threads[i], NULL, numaWorker, NULL) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    umem_stats stats;
+    assert(umemstats(&stats) == 0 && stats.allocs == 2000 && stats.frees == 2000);
+    assert(umem_check() == 0);
+    printf("%d node heap(s), 2000 blocks allocated and freed from four threads\n\n", umem_numa_nodes());
+}
+
+/* Test Case 20:
+Containers often refuse mbind with EPERM, and some kernels lack it (ENOSYS). A seccomp filter
+makes every mbind fail with EPERM here, so on a machine with several nodes umeminit has to
+fall back to placing node heaps by first touch and still come up. The rest is Test Case 19 again.
+*/
+void numaNoMbindTest() {
+    printf("Test Case 20: NUMA node heaps without mbind\n");
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_mbind, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog program = {sizeof(filter) / sizeof(filter[0]), filter};
+    assert(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0);
+    assert(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) == 0);
+    assert(syscall(SYS_mbind, NULL, 0, 0, NULL, 0, 0) == -1 && errno == EPERM);
+    numaRun();
+}
+
+/* Test Case 21:
+This test splits a 64KB BUDDY arena into fifteen blocks of mixed power of two sizes and frees them
+in a scrambled order, checking the heap after every free. Each free merges a block with its buddy
+whenever that one is free too, so at the end everything is back in one block as large as the region,
+and an allocation that needs the whole region works again. Fifteen frees stay clear of the debug quarantine.
+*/
+void buddyTest() {
+    printf("Test Case 21: Buddy splitting and merging\n");
+    umem_arena *arena = umem_arena_create(64 * 1024, BUDDY);
+    assert(arena != NULL);
+    umem_stats before, stats;
+    assert(arena_stats(arena, &before) == 0);
+    assert(before.largest_free == 64 * 1024);
+
+    size_t sizes[15] = {16, 4096, 64, 512, 32, 2048, 128, 1024, 256, 16, 2048, 64, 1024, 128, 256};
+    void *ptrs[15];
+    for (int i = 0; i < 15; i++) {
+        ptrs[i] = arena_malloc(arena, sizes[i]);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], i, sizes[i]);
+    }
+    assert(arena_check(arena) == 0);
+    assert(arena_stats(arena, &stats) == 0);
+    assert(stats.largest_free < 64 * 1024 && arena_malloc(arena, 32 * 1024 + 1) == NULL);
+    printf("15 blocks split the region, leaving a largest free block of %zu bytes\n", stats.largest_free);
+
+    // 7 and 15 are coprime, so this frees every block once, out of order
+    for (int i = 0; i < 15; i++) {
+        arena_free(arena, ptrs[i * 7 % 15]);
+        assert(arena_check(arena) == 0);
+    }
+    assert(arena_stats(arena, &stats) == 0);
+    assert(stats.in_use == 0 && stats.largest_free == before.largest_free);
+    void *whole = arena_malloc(arena, 32 * 1024 + 1);
+    assert(whole != NULL);
+    printf("Freeing them merged the buddies back into one %zu byte block\n\n", stats.largest_free);
+    umem_arena_destroy(arena);
+}
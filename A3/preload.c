@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "umem.h"
+
+/* malloc interposition
+Built as a shared library and loaded with LD_PRELOAD, this routes a program's malloc family
+through umalloc/ufree so umem can be tried on real binaries. The heap is set up on the first
+call, from the environment:
+
+    UMEM_STRATEGY   BEST_FIT (default), WORST_FIT, FIRST_FIT, NEXT_FIT, BUDDY or SLAB,
+                    optionally followed by ,HUGEPAGES ,NUMA or ,NOGROW
+    UMEM_REGION_MB  initial heap size, 64 by default
+    UMEM_STATS      if set, umemstats_json is written to stderr at exit
+
+The heap is always UMEM_THREADED, and UMEM_GROW unless BUDDY, NUMA or NOGROW rule it out.
+Anything asked for while umeminit itself runs (the NUMA fallback starts a thread, which
+can allocate) and any call racing the first one is served from a small static buffer, so
+nothing recurses into a heap that isn't there yet. Those blocks are never reused.
+The heap's locks are registered with pthread_atfork, so a child forked while another
+thread is inside umalloc still finds them free.
+
+    gcc -O2 -fPIC -shared -ftls-model=initial-exec preload.c umem.c -o libumem.so -lpthread
+    UMEM_STRATEGY=SLAB LD_PRELOAD=./libumem.so ls -l
+*/
+
+#define DEFAULT_REGION_MB 64
+#define BOOTSTRAP_SIZE    (256 * 1024)
+
+// Blocks handed out before the heap is ready keep their size just in front of them
+#define BOOTSTRAP_HEADER  16
+
+enum { HEAP_NONE, HEAP_STARTING, HEAP_READY };
+
+static atomic_int heap_state = HEAP_NONE;
+static _Alignas(64) char bootstrap[BOOTSTRAP_SIZE];
+static atomic_size_t bootstrap_used;
+
+static int is_bootstrap(const void *ptr) {
+    return (const char *)ptr >= bootstrap && (const char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static void *bootstrap_alloc(size_t alignment, size_t size) {
+    if (alignment < BOOTSTRAP_HEADER) {
+        alignment = BOOTSTRAP_HEADER;
+    }
+    size_t need = (size + BOOTSTRAP_HEADER + alignment - 1) / BOOTSTRAP_HEADER * BOOTSTRAP_HEADER;
+    size_t start = atomic_fetch_add(&bootstrap_used, need);
+    if (start + need > BOOTSTRAP_SIZE) {
+        return NULL;
+    }
+    char *ptr = bootstrap + start + BOOTSTRAP_HEADER;
+    ptr += (alignment - (size_t)ptr % alignment) % alignment;
+    *(size_t *)(ptr - sizeof(size_t)) = size;
+    return ptr;
+}
+
+// Stdio may allocate, so errors are written straight to the descriptor
+static void fail(const char *message) {
+    write(STDERR_FILENO, message, strlen(message));
+    abort();
+}
+
+// Parses UMEM_STRATEGY without touching the heap; returns -1 on an unknown name
+static int parse_strategy(const char *spec) {
+    const char *names[] = {"BEST_FIT", "WORST_FIT", "FIRST_FIT", "NEXT_FIT", "BUDDY", "SLAB"};
+    int algorithms[] = {BEST_FIT, WORST_FIT, FIRST_FIT, NEXT_FIT, BUDDY, SLAB};
+    const char *flag_names[] = {"HUGEPAGES", "NUMA", "NOGROW"};
+    int flags[] = {UMEM_HUGEPAGES, UMEM_NUMA, 0};
+    int algorithm = -1, grow = 1, extra = 0;
+
+    for (int field = 0; *spec; field++) {
+        size_t len = strcspn(spec, ",");
+        int found = 0;
+        if (field == 0) {
+            for (int i = 0; i < 6; i++) {
+                if (strlen(names[i]) == len && strncmp(spec, names[i], len) == 0) {
+                    algorithm = algorithms[i];
+                    found = 1;
+                }
+            }
+        } else {
+            for (int i = 0; i < 3; i++) {
+                if (strlen(flag_names[i]) == len && strncmp(spec, flag_names[i], len) == 0) {
+                    extra |= flags[i];
+                    grow &= i != 2;
+                    found = 1;
+                }
+            }
+        }
+        if (!found) {
+            return -1;
+        }
+        spec += len;
+        spec += *spec == ',';
+    }
+
+    // umeminit turns down a growing buddy or NUMA heap
+    if (algorithm == BUDDY || (extra & UMEM_NUMA)) {
+        grow = 0;
+    }
+    return algorithm | extra | UMEM_THREADED | (grow ? UMEM_GROW : 0);
+}
+
+static void print_stats(void) {
+    umemstats_json(stderr);
+}
+
+// Returns 1 once the heap is ready; 0 means the caller should use the bootstrap buffer
+static int heap_ready(void) {
+    int state = atomic_load_explicit(&heap_state, memory_order_acquire);
+    if (state == HEAP_READY) {
+        return 1;
+    }
+    int expected = HEAP_NONE;
+    if (state != HEAP_NONE || !atomic_compare_exchange_strong(&heap_state, &expected, HEAP_STARTING)) {
+        return 0;
+    }
+
+    const char *spec = getenv("UMEM_STRATEGY");
+    const char *region = getenv("UMEM_REGION_MB");
+    int algorithm = parse_strategy(spec && *spec ? spec : "BEST_FIT");
+    size_t mb = region && *region ? strtoul(region, NULL, 0) : DEFAULT_REGION_MB;
+    if (algorithm < 0) {
+        fail("umem: unknown UMEM_STRATEGY\n");
+    }
+    if (umeminit(mb * 1024 * 1024, algorithm) != 0) {
+        fail("umem: umeminit failed\n");
+    }
+    pthread_atfork(umem_fork_prepare, umem_fork_parent, umem_fork_child);
+    atomic_store_explicit(&heap_state, HEAP_READY, memory_order_release);
+    if (getenv("UMEM_STATS")) {
+        atexit(print_stats);
+    }
+    return 1;
+}
+
+void *malloc(size_t size) {
+    // umalloc turns down zero bytes, malloc has to hand back something freeable
+    if (size == 0) {
+        size = 1;
+    }
+    void *ptr = heap_ready() ? umalloc(size) : bootstrap_alloc(1, size);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (ptr && !is_bootstrap(ptr)) {
+        ufree(ptr);
+    }
+}
+
+void *calloc(size_t n, size_t size) {
+    if (size && n > (size_t)-1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t bytes = n * size;
+    if (bytes == 0) {
+        bytes = 1;
+    }
+    // The bootstrap buffer is static and never reused, so it is already zeroed
+    void *ptr = heap_ready() ? ucalloc(1, bytes) : bootstrap_alloc(1, bytes);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr && is_bootstrap(ptr)) {
+        // Moved out to the heap; the old block is just left behind
+        size_t old = *(size_t *)((char *)ptr - sizeof(size_t));
+        void *fresh = malloc(size);
+        if (fresh) {
+            memcpy(fresh, ptr, old < size ? old : size);
+        }
+        return fresh;
+    }
+    if (!ptr) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        ufree(ptr);
+        return NULL;
+    }
+    void *fresh = urealloc(ptr, size);
+    if (!fresh) {
+        errno = ENOMEM;
+    }
+    return fresh;
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    void *ptr = heap_ready() ? umemalign(alignment, size) : bootstrap_alloc(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+// The rest of the family, so no block from glibc's heap ever reaches ufree
+void *memalign(size_t alignment, size_t size) {
+    void *ptr = NULL;
+    int rc = posix_memalign(&ptr, alignment < sizeof(void *) ? sizeof(void *) : alignment, size);
+    if (rc != 0) {
+        errno = rc;
+    }
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    if (is_bootstrap(ptr)) {
+        return *(size_t *)((char *)ptr - sizeof(size_t));
+    }
+    return umem_usable_size(ptr);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) / page * page);
+}
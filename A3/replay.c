@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "umem.h"
+#include "trace.h"
+
+/* Trace replay
+Runs a trace recorded with umem_trace_start through umalloc/ufree under one strategy.
+The trace is decoded up front, so the timed loop only does the calls themselves and every
+run of the same trace makes exactly the same calls. A row of the fragmentation timeline is
+printed every interval events.
+
+    gcc -O2 replay.c umem.c -o replay -lpthread
+    ./replay trace.bin [strategy [region_mb [interval]]]
+*/
+
+// A decoded record; recorded pointers are replaced by slot numbers
+typedef struct event {
+    int op;
+    unsigned slot;
+    size_t size;
+    size_t alignment;
+    long long time_ns;
+} event;
+
+// Open addressed map from recorded pointers to slots
+typedef struct slot_map {
+    size_t *keys;
+    unsigned *values;
+    size_t cap;
+    size_t count;
+} slot_map;
+
+static size_t map_home(slot_map *m, size_t key) {
+    return (((key >> 4) * 0x9E3779B97F4A7C15ULL) >> 20) & (m->cap - 1);
+}
+
+static size_t map_slot(slot_map *m, size_t key) {
+    size_t i = map_home(m, key);
+    while (m->keys[i] && m->keys[i] != key) {
+        i = (i + 1) & (m->cap - 1);
+    }
+    return i;
+}
+
+static void map_put(slot_map *m, size_t key, unsigned value) {
+    if ((m->count + 1) * 2 > m->cap) {
+        slot_map bigger = {NULL, NULL, m->cap ? m->cap * 2 : 1024, 0};
+        bigger.keys = calloc(bigger.cap, sizeof(size_t));
+        bigger.values = calloc(bigger.cap, sizeof(unsigned));
+        if (!bigger.keys || !bigger.values) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < m->cap; i++) {
+            if (m->keys[i]) {
+                size_t j = map_slot(&bigger, m->keys[i]);
+                bigger.keys[j] = m->keys[i];
+                bigger.values[j] = m->values[i];
+            }
+        }
+        bigger.count = m->count;
+        free(m->keys);
+        free(m->values);
+        *m = bigger;
+    }
+    size_t i = map_slot(m, key);
+    if (!m->keys[i]) {
+        m->count++;
+    }
+    m->keys[i] = key;
+    m->values[i] = value;
+}
+
+// Removes key and returns its slot, or -1 if the pointer was never seen
+static long map_take(slot_map *m, size_t key) {
+    if (m->count == 0) {
+        return -1;
+    }
+    size_t i = map_slot(m, key);
+    if (!m->keys[i]) {
+        return -1;
+    }
+    long value = m->values[i];
+    m->keys[i] = 0;
+    m->count--;
+
+    // Shift later entries of the probe run back so lookups never stop early
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & (m->cap - 1);
+        if (!m->keys[j]) {
+            break;
+        }
+        size_t home = map_home(m, m->keys[j]);
+        if (((j - home) & (m->cap - 1)) >= ((j - i) & (m->cap - 1))) {
+            m->keys[i] = m->keys[j];
+            m->values[i] = m->values[j];
+            m->keys[j] = 0;
+            i = j;
+        }
+    }
+    return value;
+}
+
+// Decodes the whole trace; slots of freed pointers are handed out again so the
+// slot table stays as small as the largest live set
+static event *decode(const unsigned char *p, const unsigned char *end, size_t *count, size_t *slots, size_t *skipped) {
+    size_t cap = 1024, n = 0;
+    event *events = malloc(cap * sizeof(event));
+    unsigned *free_slots = malloc(1024 * sizeof(unsigned));
+    size_t free_cap = 1024, free_top = 0;
+    slot_map map = {NULL, NULL, 0, 0};
+    trace_record r = {0, 0, 0, 0, 0, 0};
+    *slots = 0;
+    *skipped = 0;
+
+    while (p < end) {
+        if (!events || !free_slots) {
+            perror("malloc");
+            exit(1);
+        }
+        p = trace_read(p, end, &r);
+        if (!p) {
+            fprintf(stderr, "trace is truncated or corrupt after %zu records\n", n);
+            break;
+        }
+        event e = {r.op, 0, r.size, r.alignment, r.time_ns};
+        size_t ptr = r.ptr, size = r.size, old = r.old;
+
+        long from = -1;
+        if (e.op == TRACE_REALLOC) {
+            if (ptr == 0 && size != 0) {
+                // Failed, so the old block stayed where it was
+                (*skipped)++;
+                continue;
+            }
+            from = old ? map_take(&map, old) : -1;
+            if (size == 0) {
+                // Reallocating to nothing frees the block
+                if (from < 0) {
+                    (*skipped)++;
+                    continue;
+                }
+                e.op = TRACE_FREE;
+            }
+        }
+
+        if (e.op == TRACE_FREE) {
+            long slot = from >= 0 ? from : map_take(&map, ptr);
+            if (slot < 0) {
+                // Allocated before recording started
+                (*skipped)++;
+                continue;
+            }
+            e.slot = (unsigned)slot;
+            if (free_top == free_cap) {
+                free_cap *= 2;
+                free_slots = realloc(free_slots, free_cap * sizeof(unsigned));
+                if (!free_slots) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            free_slots[free_top++] = e.slot;
+        } else {
+            if (ptr == 0) {
+                // The call failed when it was recorded
+                (*skipped)++;
+                continue;
+            }
+            if (from >= 0) {
+                e.slot = (unsigned)from;
+            } else {
+                // Unknown old blocks are replayed as a fresh allocation
+                e.slot = free_top ? free_slots[--free_top] : (unsigned)(*slots)++;
+            }
+            map_put(&map, ptr, e.slot);
+        }
+
+        if (n == cap) {
+            cap *= 2;
+            events = realloc(events, cap * sizeof(event));
+        }
+        events[n++] = e;
+    }
+
+    free(free_slots);
+    free(map.keys);
+    free(map.values);
+    *count = n;
+    return events;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a;
+    unsigned y = *(const unsigned *)b;
+    return (x > y) - (x < y);
+}
+
+static int parse_strategy(const char *name) {
+    const char *names[] = {"BEST_FIT", "WORST_FIT", "FIRST_FIT", "NEXT_FIT", "BUDDY", "SLAB"};
+    int algorithms[] = {BEST_FIT, WORST_FIT, FIRST_FIT, NEXT_FIT, BUDDY, SLAB};
+    for (int i = 0; i < 6; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return algorithms[i];
+        }
+    }
+    return -1;
+}
+
+static void print_row(size_t i, const event *e, long long replay_ns) {
+    umem_stats stats;
+    umemstats(&stats);
+    printf("%10zu %12.3f %12.3f %10zu %10zu %10zu %6.3f\n", i, e->time_ns / 1e6, replay_ns / 1e6,
+           stats.in_use / 1024, stats.free_bytes / 1024, stats.largest_free / 1024, stats.fragmentation);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace [strategy [region_mb [interval]]]\n", argv[0]);
+        return 1;
+    }
+    int algorithm = argc > 2 ? parse_strategy(argv[2]) : BEST_FIT;
+    size_t region = (argc > 3 ? strtoul(argv[3], NULL, 0) : 256) * 1024 * 1024;
+    if (algorithm < 0) {
+        fprintf(stderr, "unknown strategy %s\n", argv[2]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (st.st_size < TRACE_MAGIC_LEN) {
+        fprintf(stderr, "%s is not a umem trace\n", argv[1]);
+        return 1;
+    }
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+    if (memcmp(data, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s is not a umem trace\n", argv[1]);
+        return 1;
+    }
+
+    size_t n, nslots, skipped;
+    event *events = decode(data + TRACE_MAGIC_LEN, data + st.st_size, &n, &nslots, &skipped);
+    munmap(data, st.st_size);
+    if (n == 0) {
+        fprintf(stderr, "%s holds no replayable records\n", argv[1]);
+        return 1;
+    }
+    size_t interval = argc > 4 ? strtoul(argv[4], NULL, 0) : (n + 19) / 20;
+    if (interval == 0) {
+        interval = 1;
+    }
+
+    void **slots = calloc(nslots, sizeof(void *));
+    unsigned *ns = malloc(n * sizeof(unsigned));
+    if (!slots || !ns) {
+        perror("malloc");
+        return 1;
+    }
+    if (umeminit(region, algorithm) != 0) {
+        fprintf(stderr, "umeminit failed\n");
+        return 1;
+    }
+
+    printf("%zu events from %s under %s, %zu records skipped\n\n", n, argv[1], argc > 2 ? argv[2] : "BEST_FIT", skipped);
+    printf("%10s %12s %12s %10s %10s %10s %6s\n", "event", "trace(ms)", "replay(ms)", "in_use(KB)", "free(KB)", "largest", "frag");
+
+    size_t failures = 0;
+    long long total = 0;
+    for (size_t i = 0; i < n; i++) {
+        event *e = &events[i];
+        long long start = now_ns();
+        if (e->op == TRACE_FREE) {
+            ufree(slots[e->slot]);
+            slots[e->slot] = NULL;
+        } else {
+            void *ptr;
+            if (e->op == TRACE_ALLOC) {
+                ptr = umalloc(e->size);
+            } else if (e->op == TRACE_CALLOC) {
+                ptr = ucalloc(1, e->size);
+            } else if (e->op == TRACE_REALLOC) {
+                ptr = urealloc(slots[e->slot], e->size);
+            } else {
+                ptr = umemalign(e->alignment, e->size);
+            }
+            if (ptr) {
+                slots[e->slot] = ptr;
+            } else {
+                failures++;
+            }
+        }
+        long long took = now_ns() - start;
+        ns[i] = (unsigned)took;
+        total += took;
+
+        if (i % interval == interval - 1 || i == n - 1) {
+            print_row(i + 1, e, total);
+        }
+    }
+
+    qsort(ns, n, sizeof(unsigned), compare_ns);
+    printf("\n%zu failed allocations, %.1f ns/op, p50 %u ns, p99 %u ns, p99.9 %u ns\n", failures,
+           (double)total / n, ns[n / 2], ns[n * 99 / 100], ns[n * 999 / 1000]);
+    umemstats_json(stdout);
+    return 0;
+}
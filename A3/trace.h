@@ -0,0 +1,102 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+// Binary allocation traces, written by umem_trace_start and read by replay.
+// A trace is TRACE_MAGIC followed by one record per call:
+//   op byte
+//   varint: pointer minus the previous record's pointer, zigzag encoded
+//   varint: nanoseconds since the previous record
+//   varint: requested size (everything but TRACE_FREE)
+//   varint: alignment (TRACE_MEMALIGN only)
+//   varint: old pointer minus the new one, zigzag encoded (TRACE_REALLOC only)
+// A NULL pointer on an allocation means the call failed when it was recorded,
+// as does a NULL from TRACE_REALLOC with a non-zero size.
+
+#define TRACE_MAGIC     "UMTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+#define TRACE_ALLOC     1
+#define TRACE_FREE      2
+#define TRACE_MEMALIGN  3
+#define TRACE_REALLOC   4
+#define TRACE_CALLOC    5
+
+// Longest encoding of a 64-bit varint and of a whole record
+#define TRACE_VARINT_MAX 10
+#define TRACE_RECORD_MAX (1 + 4 * TRACE_VARINT_MAX)
+
+static inline unsigned long long trace_zigzag(long long v) {
+    return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+static inline long long trace_unzigzag(unsigned long long v) {
+    return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static inline unsigned char *trace_put(unsigned char *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+// Returns NULL if the varint runs past end
+static inline const unsigned char *trace_get(const unsigned char *p, const unsigned char *end, unsigned long long *v) {
+    unsigned long long result = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char byte = *p++;
+        result |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// One record with its pointers and time made absolute; old is only set by
+// TRACE_REALLOC. Zero the first one read, later reads carry on from it.
+typedef struct trace_record {
+    int op;
+    size_t ptr;
+    size_t size;
+    size_t alignment;
+    size_t old;
+    long long time_ns;
+} trace_record;
+
+// Reads the record at p; returns NULL if it is truncated or its op is unknown
+static inline const unsigned char *trace_read(const unsigned char *p, const unsigned char *end, trace_record *r) {
+    unsigned long long delta = 0, ns = 0, size = 0, alignment = 0, old = 0;
+    if (p >= end) {
+        return NULL;
+    }
+    int op = *p++;
+    p = trace_get(p, end, &delta);
+    if (p) {
+        p = trace_get(p, end, &ns);
+    }
+    if (p && op != TRACE_FREE) {
+        p = trace_get(p, end, &size);
+    }
+    if (p && op == TRACE_MEMALIGN) {
+        p = trace_get(p, end, &alignment);
+    }
+    if (p && op == TRACE_REALLOC) {
+        p = trace_get(p, end, &old);
+    }
+    if (!p || op < TRACE_ALLOC || op > TRACE_CALLOC) {
+        return NULL;
+    }
+    r->op = op;
+    r->ptr += (size_t)trace_unzigzag(delta);
+    r->time_ns += (long long)ns;
+    r->size = size;
+    r->alignment = alignment;
+    r->old = op == TRACE_REALLOC ? r->ptr + (size_t)trace_unzigzag(old) : 0;
+    return p;
+}
+
+#endif
@@ -1,156 +1,2999 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "umem.h"
+#include "trace.h"
 
-#define HEADER_SIZE 32
-
+// Blocks are laid out back to back, so the next block is found from the size
+// and the previous one from the prev link. The low bits of size are flags and
+// the top bits name the thread cache that handed the block out.
+// Building with -DUMEM_DEBUG adds a magic word and the requested size, which
+// place a canary after the payload.
 typedef struct block {
     size_t size;
-    int free;
-    struct block *next;
+    struct block *prev;
+#ifdef UMEM_DEBUG
+    size_t magic;
+    size_t request;
+#endif
 } block;
 
-static block *head = NULL;
-static block *next_fit_ptr = NULL;
-static int algorithm;
-static size_t total_size;
+#define HEADER_SIZE (sizeof(block))
 
-int umeminit(size_t sizeOfRegion, int allocationAlgo) {
-    if (head != NULL || sizeOfRegion <= 0) {
-        return -1;
+// Every payload starts on this boundary; block sizes are multiples of it
+#define ALIGNMENT   16
+#define ALIGN_UP(x, n) (((size_t)(x) + (n) - 1) & ~((size_t)(n) - 1))
+
+#define BLOCK_FREE  ((size_t)1)
+#define BLOCK_LARGE ((size_t)2)
+#define BLOCK_SHIFTED ((size_t)4)
+#define FLAG_MASK   ((size_t)7)
+#define OWNER_SHIFT 48
+#define SIZE_MASK   ((((size_t)1 << OWNER_SHIFT) - 1) & ~FLAG_MASK)
+
+#define SIZE(b)     ((b)->size & SIZE_MASK)
+#define OWNER(b)    ((b)->size >> OWNER_SHIFT)
+#define IS_FREE(b)  ((b)->size & BLOCK_FREE)
+#define NEXT(b)     ((block *)((char *)(b) + SIZE(b)))
+
+#ifdef UMEM_DEBUG
+#define MAGIC_LIVE   ((size_t)0x6c697665626c6f63ULL)
+#define MAGIC_FREED  ((size_t)0x6465616462656566ULL)
+#define CANARY       ((size_t)0xc0ffee15deadbeefULL)
+#define CANARY_SIZE  sizeof(size_t)
+#define POISON       0xdf
+#define POISON_BYTES 64
+// One free in QUARANTINE_SAMPLE is poisoned and held for QUARANTINE more
+// samples, about 256 frees. Every free is still checked. On bench.c the
+// checks alone cost about 3% and the sampled quarantine brings that to 7-9%,
+// short of the 5% aimed for: held blocks split free runs, which costs the
+// address ordered policies up to 40% on prodcons. Holding every free for
+// 256 frees cost 16%.
+#define QUARANTINE   16
+#define QUARANTINE_SAMPLE 16
+#else
+#define CANARY_SIZE  0
+#endif
+
+// Free blocks keep their links at the start of the payload,
+// so every block needs at least this much payload.
+typedef struct free_links {
+    struct block *next;
+    struct block *prev;
+} free_links;
+
+#define LINKS(b) ((free_links *)((char *)(b) + HEADER_SIZE))
+#define MIN_PAYLOAD (sizeof(free_links))
+
+// In the bins of a fit heap the same two words are tree links instead. Blocks
+// of the range bins are at least SMALL_LIMIT bytes and also keep the largest
+// block size in their subtree.
+typedef struct bin_node {
+    struct block *left;
+    struct block *right;
+    size_t max;
+} bin_node;
+
+#define NODE(b) ((bin_node *)((char *)(b) + HEADER_SIZE))
+// Bytes at the start of a free payload that links may have been written to
+#define LINK_BYTES (sizeof(bin_node))
+
+// Segregated size classes: one exact bin per 16 bytes below SMALL_LIMIT,
+// then four bins per power of two above it.
+#define SMALL_LIMIT 1024
+#define SMALL_SHIFT 10
+#define SMALL_BINS (SMALL_LIMIT / ALIGNMENT)
+#define NBINS (SMALL_BINS + (64 - SMALL_SHIFT) * 4)
+#define BIN_WORDS ((NBINS + 63) / 64)
+
+// Binary buddy bookkeeping, only used when algorithm == BUDDY.
+// Buddy blocks share the block header; size is always a power of two.
+#define BUDDY_MIN_ORDER 5
+#define BUDDY_MAX_ORDER 48
+
+// Thread caches for UMEM_THREADED: one exact bin per 16 bytes of block size
+// up to TCACHE_LIMIT, touched only by the owning thread. Other threads hand
+// blocks back through the lock-free remote stack.
+#define TCACHE_LIMIT   (512 + HEADER_SIZE)
+#define TCACHE_CLASSES (TCACHE_LIMIT / ALIGNMENT + 1)
+#define TCACHE_CAP     32
+#define TCACHE_BATCH   16
+#define MAX_THREADS    256
+
+// Marks the remote stack of a cache whose thread has exited
+#define REMOTE_CLOSED  ((block *)1)
+
+// Calls a cache serves are counted there rather than in main_arena's stats,
+// which only see what reaches the backend; arena_stats adds them in.
+typedef struct tcache {
+    atomic_int live;
+    block *bin[TCACHE_CLASSES];
+    unsigned count[TCACHE_CLASSES];
+    _Atomic(block *) remote;
+    atomic_size_t allocs;
+    atomic_size_t frees;
+} tcache;
+
+// SLAB arenas carve SLAB_SIZE-aligned slabs out of the heap and cut each
+// into equal slots with no per-object header. The heap block holding a slab
+// starts on the boundary, so masking an object's address gives the block and
+// the slab table confirms it really is one.
+#define SLAB_SHIFT   16
+#define SLAB_SIZE    ((size_t)1 << SLAB_SHIFT)
+#define SLAB_MAX     512
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+    void *free_list;
+    char *bump;
+    unsigned obj_size;
+    unsigned used;
+    unsigned capacity;
+    unsigned cls;
+#ifdef UMEM_DEBUG
+    // One bit per slot that is handed out, so a second free is caught
+    unsigned char live[SLAB_SIZE / ALIGNMENT / 8];
+#endif
+} slab;
+
+#define SLAB_OF(base)   ((slab *)((char *)(base) + HEADER_SIZE))
+#define SLAB_BASE(s)    ((char *)(s) - HEADER_SIZE)
+#define SLAB_OBJECTS(s) ((char *)(s) + ALIGN_UP(sizeof(slab), ALIGNMENT))
+
+// Extra regions mapped by UMEM_GROW arenas. Each one holds a block chain
+// of its own, ended by a fence, so blocks never coalesce across chunks.
+// Large objects get a mapping of their own with the same header in front.
+typedef struct chunk {
+    struct chunk *next;
+    struct chunk *prev;
+    size_t map_size;
+    block *first;
+} chunk;
+
+#define TRIM_THRESHOLD_DEFAULT (128 * 1024)
+#define MMAP_THRESHOLD_DEFAULT (256 * 1024)
+#define HUGE_PAGE_SIZE         (2 * 1024 * 1024)
+#define ALGO_MASK 0xff
+
+// Everything one heap needs. umeminit/umalloc/ufree work on main_arena;
+// umem_arena_create places further arenas at the start of their own mapping.
+struct umem_arena {
+    int algorithm;
+    int threaded;
+    int grow;
+    int hugepages;
+    size_t total_size;
+    size_t map_size;
+    pthread_mutex_t lock;
+
+    // Growth and trimming
+    chunk *chunks;
+    size_t free_bytes;
+    size_t trim_threshold;
+
+    // Everything in the base region from here on has never been written
+    // or had its pages dropped by trim, so it reads as zero
+    char *untouched;
+
+    // Requests of at least mmap_threshold bytes bypass the heap
+    chunk *large;
+    size_t mmap_threshold;
+
+    // SLAB mode: partially used slabs per class and the set of live slabs
+    int slabs;
+    slab *slab_partial[SLAB_CLASSES];
+    char **slab_table;
+    size_t slab_cap;
+    size_t slab_count;
+    size_t slab_empty;
+
+    block *head;
+    block *next_fit_ptr;
+    block *bins[NBINS];
+    // The block each bin orders first: its smallest under BEST_FIT, its
+    // largest under WORST_FIT and its lowest address otherwise
+    block *bin_first[NBINS];
+    // Two-level index of the non-empty bins: a bit per bin, and a bit per
+    // word of bin_map that has any bit set
+    size_t bin_map[BIN_WORDS];
+    size_t bin_summary;
+
+    char *buddy_base;
+    size_t buddy_top;
+    block *buddy_free[BUDDY_MAX_ORDER + 1];
+
+    // Raw counters; the derived fields are filled in by arena_stats
+    umem_stats stats;
+
+#ifdef UMEM_DEBUG
+    // Freed blocks wait here before going back to the heap
+    void *quarantine[QUARANTINE];
+    size_t quarantine_next;
+    atomic_uint quarantine_tick;
+#endif
+};
+
+static umem_arena main_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// UMEM_NUMA: the node heaps are consecutive slices of one mapping, so the
+// node of a heap pointer is its offset over the slice size. main_arena is
+// the first node's heap and also keeps every large object.
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS  1024
+#define NUMA_MPOL_BIND 2
+
+static int numa_nodes = 1;
+static umem_arena *numa_arenas[NUMA_MAX_NODES] = { &main_arena };
+static char *numa_base;
+static size_t numa_stride;
+static unsigned char numa_cpu_node[NUMA_MAX_CPUS];
+
+// Thread caches only ever hold blocks of main_arena
+static tcache caches[MAX_THREADS];
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread int cache_id = -1;
+
+// Trace recording of the main_arena calls, see trace.h for the format
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int tracing;
+static int trace_fd = -1;
+static unsigned char trace_buf[64 * 1024];
+static size_t trace_len;
+static size_t trace_last_ptr;
+static long long trace_last_ns;
+
+static void buddy_push(umem_arena *a, block *b, size_t order) {
+    b->size = ((size_t)1 << order) | BLOCK_FREE;
+    LINKS(b)->prev = NULL;
+    LINKS(b)->next = a->buddy_free[order];
+    if (LINKS(b)->next) {
+        LINKS(LINKS(b)->next)->prev = b;
+    }
+    a->buddy_free[order] = b;
+}
+
+static void buddy_unlink(umem_arena *a, block *b, size_t order) {
+    free_links *l = LINKS(b);
+    if (l->prev) {
+        LINKS(l->prev)->next = l->next;
+    } else {
+        a->buddy_free[order] = l->next;
     }
+    if (l->next) {
+        LINKS(l->next)->prev = l->prev;
+    }
+}
 
-    size_t adjustedSize = sizeOfRegion + HEADER_SIZE;
+static void *buddy_alloc(umem_arena *a, size_t size) {
+    size_t order = BUDDY_MIN_ORDER;
+    while (((size_t)1 << order) < size) {
+        if (++order > a->buddy_top) {
+            return NULL;
+        }
+    }
 
-    void *ptr = mmap(NULL, adjustedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (ptr == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
+    // Smallest non-empty order that can hold the request
+    size_t k = order;
+    a->stats.searches++;
+    while (k <= a->buddy_top && !a->buddy_free[k]) {
+        a->stats.probes++;
+        k++;
+    }
+    if (k > a->buddy_top) {
+        return NULL;
     }
 
-    head = (block *)ptr;
-    // Adjusted for the space of the header
-    head->size = sizeOfRegion - HEADER_SIZE;  
-    head->free = 1;
-    head->next = NULL;
+    block *b = a->buddy_free[k];
+    buddy_unlink(a, b, k);
 
-    algorithm = allocationAlgo;
-    total_size = sizeOfRegion;
+    // Split down, handing the upper half of each split to the free lists
+    while (k > order) {
+        k--;
+        buddy_push(a, (block *)((char *)b + ((size_t)1 << k)), k);
+        a->stats.splits++;
+    }
 
-    return 0;
+    b->size = (size_t)1 << order;
+    return (void *)((char *)b + HEADER_SIZE);
 }
 
-void *umalloc(size_t size) {
-    if (head == NULL || size == 0) {
+static void buddy_release(umem_arena *a, void *ptr) {
+    block *b = (block *)((char *)ptr - HEADER_SIZE);
+    size_t order = __builtin_ctzl(SIZE(b));
+
+    // Merge upwards while the buddy is free and whole
+    while (order < a->buddy_top) {
+        size_t offset = (size_t)((char *)b - a->buddy_base);
+        block *mate = (block *)(a->buddy_base + (offset ^ ((size_t)1 << order)));
+        if (!IS_FREE(mate) || SIZE(mate) != ((size_t)1 << order)) {
+            break;
+        }
+        buddy_unlink(a, mate, order);
+        if (mate < b) {
+            b = mate;
+        }
+        order++;
+        a->stats.coalesces++;
+    }
+
+    buddy_push(a, b, order);
+}
+
+static size_t bin_index(size_t size) {
+    if (size < SMALL_LIMIT) {
+        return size / ALIGNMENT;
+    }
+    size_t fl = 63 - __builtin_clzl(size);
+    return SMALL_BINS + (fl - SMALL_SHIFT) * 4 + ((size >> (fl - 2)) & 3);
+}
+
+// An exact bin holds a single size, so under BEST_FIT and WORST_FIT it is a
+// plain list pushed and popped at the head, and ties there go to the most
+// recently freed block. Every other bin is a treap ordered by bin_before:
+// BEST_FIT by size, WORST_FIT by descending size and the address based
+// policies by address, with ties going to the lower address. The heap
+// priority is a hash of the block's address, so the tree stays balanced
+// whatever order blocks are freed in and nothing but the two child links has
+// to be stored.
+static int bin_before(umem_arena *a, block *x, block *y) {
+    if (a->algorithm == BEST_FIT && SIZE(x) != SIZE(y)) {
+        return SIZE(x) < SIZE(y);
+    }
+    if (a->algorithm == WORST_FIT && SIZE(x) != SIZE(y)) {
+        return SIZE(x) > SIZE(y);
+    }
+    return x < y;
+}
+
+static size_t bin_priority(block *b) {
+    size_t x = (size_t)b;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Largest block in a subtree; an exact bin holds a single size
+static size_t node_max(block *t) {
+    if (!t) {
+        return 0;
+    }
+    return SIZE(t) >= SMALL_LIMIT ? NODE(t)->max : SIZE(t);
+}
+
+static void node_update(block *t) {
+    if (SIZE(t) >= SMALL_LIMIT) {
+        size_t max = SIZE(t);
+        size_t left = node_max(NODE(t)->left);
+        size_t right = node_max(NODE(t)->right);
+        if (left > max) {
+            max = left;
+        }
+        if (right > max) {
+            max = right;
+        }
+        NODE(t)->max = max;
+    }
+}
+
+// Recomputes the largest sizes down one side of a subtree, deepest first
+static void node_spine(block *t, int right) {
+    if (t) {
+        node_spine(right ? NODE(t)->right : NODE(t)->left, right);
+        node_update(t);
+    }
+}
+
+// Recomputes the largest sizes on the path b's key takes, deepest first
+static void node_refresh(umem_arena *a, block *t, block *b) {
+    if (t) {
+        node_refresh(a, bin_before(a, b, t) ? NODE(t)->left : NODE(t)->right, b);
+        node_update(t);
+    }
+}
+
+static block *node_insert(umem_arena *a, block *root, block *b) {
+    size_t priority = bin_priority(b);
+    block **link = &root;
+    while (*link && bin_priority(*link) > priority) {
+        block *t = *link;
+        // Blocks above b only gain it, so their largest sizes rise on the way down
+        if (SIZE(t) >= SMALL_LIMIT && NODE(t)->max < SIZE(b)) {
+            NODE(t)->max = SIZE(b);
+        }
+        link = bin_before(a, b, t) ? &NODE(t)->left : &NODE(t)->right;
+    }
+
+    // Split what hangs below into the blocks before and after b
+    block *t = *link;
+    block **before = &NODE(b)->left;
+    block **after = &NODE(b)->right;
+    while (t) {
+        if (bin_before(a, t, b)) {
+            *before = t;
+            before = &NODE(t)->right;
+            t = NODE(t)->right;
+        } else {
+            *after = t;
+            after = &NODE(t)->left;
+            t = NODE(t)->left;
+        }
+    }
+    *before = NULL;
+    *after = NULL;
+    *link = b;
+    if (SIZE(b) >= SMALL_LIMIT) {
+        node_spine(NODE(b)->left, 1);
+        node_spine(NODE(b)->right, 0);
+        node_update(b);
+    }
+    return root;
+}
+
+static block *node_remove(umem_arena *a, block *root, block *b) {
+    block **link = &root;
+    while (*link && *link != b) {
+        link = bin_before(a, b, *link) ? &NODE(*link)->left : &NODE(*link)->right;
+    }
+    if (!*link) {
+        return root;
+    }
+
+    // Zip b's subtrees together in priority order
+    block *x = NODE(b)->left;
+    block *y = NODE(b)->right;
+    while (x && y) {
+        if (bin_priority(x) > bin_priority(y)) {
+            *link = x;
+            link = &NODE(x)->right;
+            x = *link;
+        } else {
+            *link = y;
+            link = &NODE(y)->left;
+            y = *link;
+        }
+    }
+    *link = x ? x : y;
+
+    // The path down to b and the zipped seam both lie along b's key
+    if (SIZE(b) >= SMALL_LIMIT) {
+        node_refresh(a, root, b);
+    }
+    return root;
+}
+
+// Refreshes the largest sizes on the path down to b after b grew in place
+static void node_grown(umem_arena *a, block *t, block *b) {
+    if (t != b) {
+        node_grown(a, bin_before(a, b, t) ? NODE(t)->left : NODE(t)->right, b);
+    }
+    node_update(t);
+}
+
+// Smallest block of at least size in a BEST_FIT bin
+static block *node_lower(umem_arena *a, block *t, size_t size) {
+    block *found = NULL;
+    while (t) {
+        a->stats.probes++;
+        if (SIZE(t) >= size) {
+            found = t;
+            t = NODE(t)->left;
+        } else {
+            t = NODE(t)->right;
+        }
+    }
+    return found;
+}
+
+// Lowest addressed block of at least size at or past from, in an address
+// ordered bin. Subtrees whose largest block is too small are skipped whole,
+// so at most one path down is followed past the blocks before from.
+static block *node_fit(umem_arena *a, block *t, size_t size, block *from) {
+    if (!t || node_max(t) < size) {
         return NULL;
     }
-    // This rounds to the nearest 8 
-    size = (size + 7) / 8 * 8; 
-    size += HEADER_SIZE;
-    
-    block *best = NULL;
-    block *current = head;
-    
-    if (algorithm == BEST_FIT) {
-        size_t min_size = total_size + 1;
-        while (current) {
-            if (current->free && current->size >= size && current->size < min_size) {
-                best = current;
-                min_size = current->size;
-            }
-            current = current->next;
-        }
-    } else if (algorithm == WORST_FIT) {
-        size_t max_size = 0;
-        while (current) {
-            if (current->free && current->size >= size && current->size > max_size) {
-                best = current;
-                max_size = current->size;
-            }
-            current = current->next;
-        }
-    } else if (algorithm == FIRST_FIT) {
-        while (current) {
-            if (current->free && current->size >= size) {
-                best = current;
-                break;
+    a->stats.probes++;
+    if (t < from) {
+        return node_fit(a, NODE(t)->right, size, from);
+    }
+    block *b = node_fit(a, NODE(t)->left, size, from);
+    if (b) {
+        return b;
+    }
+    if (SIZE(t) >= size) {
+        return t;
+    }
+    return node_fit(a, NODE(t)->right, size, from);
+}
+
+static void bin_mark(umem_arena *a, size_t idx) {
+    a->bin_map[idx / 64] |= (size_t)1 << (idx % 64);
+    a->bin_summary |= (size_t)1 << (idx / 64);
+}
+
+static void bin_unmark(umem_arena *a, size_t idx) {
+    a->bin_map[idx / 64] &= ~((size_t)1 << (idx % 64));
+    if (a->bin_map[idx / 64] == 0) {
+        a->bin_summary &= ~((size_t)1 << (idx / 64));
+    }
+}
+
+// First non-empty bin at or above idx, or NBINS if there is none
+static size_t bin_next(umem_arena *a, size_t idx) {
+    if (idx >= NBINS) {
+        return NBINS;
+    }
+    size_t word = idx / 64;
+    size_t bits = a->bin_map[word] & (~(size_t)0 << (idx % 64));
+    if (!bits) {
+        size_t words = a->bin_summary & (~(size_t)1 << word);
+        if (!words) {
+            return NBINS;
+        }
+        word = __builtin_ctzl(words);
+        bits = a->bin_map[word];
+    }
+    return word * 64 + __builtin_ctzl(bits);
+}
+
+// Highest non-empty bin, or NBINS if every bin is empty
+static size_t bin_last(umem_arena *a) {
+    if (!a->bin_summary) {
+        return NBINS;
+    }
+    size_t word = 63 - __builtin_clzl(a->bin_summary);
+    return word * 64 + 63 - __builtin_clzl(a->bin_map[word]);
+}
+
+static int bin_listed(umem_arena *a, size_t idx) {
+    return idx < SMALL_BINS && (a->algorithm == BEST_FIT || a->algorithm == WORST_FIT);
+}
+
+// Insertion and removal are O(1) in list bins and O(log n) in the bin's
+// population otherwise
+static void bin_insert(umem_arena *a, block *b) {
+    size_t idx = bin_index(SIZE(b));
+    if (!a->bins[idx]) {
+        bin_mark(a, idx);
+    }
+    if (bin_listed(a, idx)) {
+        LINKS(b)->prev = NULL;
+        LINKS(b)->next = a->bins[idx];
+        if (LINKS(b)->next) {
+            LINKS(LINKS(b)->next)->prev = b;
+        }
+        a->bins[idx] = b;
+        a->bin_first[idx] = b;
+        return;
+    }
+    a->bins[idx] = node_insert(a, a->bins[idx], b);
+    if (!a->bin_first[idx] || bin_before(a, b, a->bin_first[idx])) {
+        a->bin_first[idx] = b;
+    }
+}
+
+static void bin_remove(umem_arena *a, block *b) {
+    size_t idx = bin_index(SIZE(b));
+    if (bin_listed(a, idx)) {
+        free_links *l = LINKS(b);
+        if (l->prev) {
+            LINKS(l->prev)->next = l->next;
+        } else {
+            a->bins[idx] = l->next;
+            a->bin_first[idx] = l->next;
+            if (!l->next) {
+                bin_unmark(a, idx);
             }
-            current = current->next;
         }
-    } else if (algorithm == NEXT_FIT) {
-        if (!next_fit_ptr) {
-            next_fit_ptr = head;
+        if (l->next) {
+            LINKS(l->next)->prev = l->prev;
         }
-        current = next_fit_ptr;
-        while (current) {
-            if (current->free && current->size >= size) {
-                best = current;
-                next_fit_ptr = current->next;
-                break;
+        return;
+    }
+    block *t = node_remove(a, a->bins[idx], b);
+    a->bins[idx] = t;
+    if (!t) {
+        bin_unmark(a, idx);
+    }
+    if (a->bin_first[idx] == b) {
+        while (t && NODE(t)->left) {
+            t = NODE(t)->left;
+        }
+        a->bin_first[idx] = t;
+    }
+}
+
+// The bin comes from the bitmap in a couple of ctz/clz and the block from
+// the bin's cached first block, so BEST_FIT and WORST_FIT answer in O(1).
+// The one exception is a request whose own range bin holds blocks too small
+// for it: BEST_FIT then descends that bin's tree, in O(log n). FIRST_FIT and
+// NEXT_FIT are not O(1): they compare one candidate per non-empty bin that
+// can fit, up to NBINS of them, and descend a tree in O(log n) only for the
+// request's own bin or a bin whose first block lies before the rover.
+// Every block or bin looked at counts as a probe.
+static block *bin_find(umem_arena *a, size_t size) {
+    size_t first = bin_index(size);
+    size_t idx = bin_next(a, first);
+    if (idx == NBINS) {
+        return NULL;
+    }
+
+    if (a->algorithm == BEST_FIT) {
+        a->stats.probes++;
+        if (idx == first && SIZE(a->bin_first[idx]) < size) {
+            // Only a range bin mixes sizes
+            block *b = idx >= SMALL_BINS ? node_lower(a, a->bins[idx], size) : NULL;
+            if (b) {
+                return b;
             }
-            current = current->next;
-            if (!current) {
-                current = head;
+            idx = bin_next(a, idx + 1);
+            if (idx == NBINS) {
+                return NULL;
             }
-            if (current == next_fit_ptr) {
-                break;
+        }
+        return a->bin_first[idx];
+    }
+    if (a->algorithm == WORST_FIT) {
+        // The first block of the highest bin is the largest free block
+        block *b = a->bin_first[bin_last(a)];
+        a->stats.probes++;
+        return SIZE(b) >= size ? b : NULL;
+    }
+
+    // The lowest fitting address over every bin that can fit; NEXT_FIT looks
+    // at or past the rover first and wraps around to the start
+    block *from = a->algorithm == NEXT_FIT ? a->next_fit_ptr : NULL;
+    for (;;) {
+        block *best = NULL;
+        for (; idx < NBINS; idx = bin_next(a, idx + 1)) {
+            block *b = a->bin_first[idx];
+            a->stats.probes++;
+            if (b < from || (idx == first && SIZE(b) < size)) {
+                b = node_fit(a, a->bins[idx], size, from);
             }
+            if (b && (!best || b < best)) {
+                best = b;
+            }
+        }
+        if (best || !from) {
+            return best;
         }
+        from = NULL;
+        idx = bin_next(a, first);
     }
-    
-    if (!best) {
-        return NULL;
+}
+
+static size_t page_size(void) {
+    static size_t page;
+    if (page == 0) {
+        page = (size_t)sysconf(_SC_PAGESIZE);
     }
-    
-    if (best->size >= size + HEADER_SIZE) {
-        block *new_block = (block *)((char *)best + size);
-        new_block->size = best->size - size;
-        new_block->free = 1;
-        new_block->next = best->next;
-        best->size = size;
-        best->next = new_block;
-    }
-    
-    best->free = 0;
-    return (void *)((char *)best + HEADER_SIZE);
+    return page;
 }
 
-int ufree(void *ptr) {
-    if (!ptr) {
+// Bytes of heap an arena gets for a requested region, or 0 if it can't be built.
+static size_t heap_span(size_t sizeOfRegion, int allocationAlgo) {
+    if (allocationAlgo == BUDDY) {
+        size_t order = BUDDY_MIN_ORDER;
+        while (((size_t)1 << order) < sizeOfRegion) {
+            if (++order > BUDDY_MAX_ORDER) {
+                return 0;
+            }
+        }
+        return (size_t)1 << order;
+    }
+
+    // Keep the region a whole number of blocks
+    sizeOfRegion = ALIGN_UP(sizeOfRegion, ALIGNMENT);
+    if (sizeOfRegion < HEADER_SIZE + MIN_PAYLOAD) {
         return 0;
     }
-    
-    block *current = (block *)((char *)ptr - HEADER_SIZE);
-    current->free = 1;
-    
-    // Coalesce with next block if free
-    if (current->next && current->next->free) {
-        current->size += current->next->size + HEADER_SIZE;
-        current->next = current->next->next;
+    return sizeOfRegion;
+}
+
+// Lays a fresh, entirely free heap over the arena's region. Only the free
+// structures are touched, so the cost does not depend on what was live.
+static void arena_format(umem_arena *a) {
+#ifdef UMEM_DEBUG
+    memset(a->quarantine, 0, sizeof(a->quarantine));
+    atomic_store(&a->quarantine_tick, 0);
+#endif
+    a->free_bytes = a->total_size;
+    a->stats.in_use = 0;
+    a->stats.mapped = a->map_size;
+    if (a->algorithm == BUDDY) {
+        memset(a->buddy_free, 0, sizeof(a->buddy_free));
+        buddy_push(a, (block *)a->buddy_base, a->buddy_top);
+        return;
+    }
+
+    memset(a->bins, 0, sizeof(a->bins));
+    memset(a->bin_first, 0, sizeof(a->bin_first));
+    memset(a->bin_map, 0, sizeof(a->bin_map));
+    a->bin_summary = 0;
+    memset(a->slab_partial, 0, sizeof(a->slab_partial));
+    a->slab_table = NULL;
+    a->slab_cap = 0;
+    a->slab_count = 0;
+    a->slab_empty = 0;
+    a->next_fit_ptr = NULL;
+    a->untouched = (char *)a->head + a->total_size;
+    a->head->size = a->total_size | BLOCK_FREE;
+    a->head->prev = NULL;
+
+    // A zero sized, allocated fence is never coalesced past
+    block *fence = NEXT(a->head);
+    fence->size = 0;
+    fence->prev = a->head;
+
+    bin_insert(a, a->head);
+}
+
+static void arena_open(umem_arena *a, char *heap, size_t span, int allocationAlgo) {
+    a->threaded = (allocationAlgo & UMEM_THREADED) != 0;
+    a->grow = (allocationAlgo & UMEM_GROW) != 0;
+    a->hugepages = (allocationAlgo & UMEM_HUGEPAGES) != 0;
+    a->algorithm = allocationAlgo & ALGO_MASK;
+    if (a->algorithm == SLAB) {
+        // Slabs and anything too big for them come from a best fit heap
+        a->slabs = 1;
+        a->algorithm = BEST_FIT;
+    }
+    a->total_size = span;
+    a->trim_threshold = TRIM_THRESHOLD_DEFAULT;
+    a->mmap_threshold = MMAP_THRESHOLD_DEFAULT;
+
+    if (a->algorithm == BUDDY) {
+        a->buddy_base = heap;
+        a->buddy_top = __builtin_ctzl(span);
+    } else {
+        a->head = (block *)heap;
+    }
+    arena_format(a);
+    if (a->algorithm != BUDDY) {
+        // A fresh mapping is zero past the first block's header and links
+        a->untouched = (char *)LINKS(a->head) + LINK_BYTES;
+    }
+}
+
+static void *map_region(size_t bytes) {
+    void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return ptr;
+}
+
+// Reads a sysfs list such as "0-3,8,10-11" into ids and returns how many
+// there were. Plain read(2) so umeminit never calls malloc.
+static int numa_read_list(const char *path, int *ids, int max) {
+    char buf[4096];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+
+    int count = 0;
+    for (char *p = buf; *p >= '0' && *p <= '9'; p++) {
+        long lo = strtol(p, &p, 10);
+        long hi = lo;
+        if (*p == '-') {
+            hi = strtol(p + 1, &p, 10);
+        }
+        for (long id = lo; id <= hi && count < max; id++) {
+            ids[count++] = (int)id;
+        }
+        if (*p != ',') {
+            break;
+        }
+    }
+    return count;
+}
+
+// Finds the nodes that have memory and fills in which of them each CPU is
+// on. CPUs of memoryless nodes are left on the first node.
+static int numa_discover(int *ids) {
+    int nodes = numa_read_list("/sys/devices/system/node/has_memory", ids, NUMA_MAX_NODES);
+    if (nodes == 0) {
+        nodes = numa_read_list("/sys/devices/system/node/online", ids, NUMA_MAX_NODES);
+    }
+    for (int i = 0; i < nodes; i++) {
+        char path[64];
+        int cpus[NUMA_MAX_CPUS];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+        int count = numa_read_list(path, cpus, NUMA_MAX_CPUS);
+        for (int k = 0; k < count; k++) {
+            if (cpus[k] < NUMA_MAX_CPUS) {
+                numa_cpu_node[cpus[k]] = (unsigned char)i;
+            }
+        }
+    }
+    return nodes;
+}
+
+typedef struct numa_slice {
+    char *start;
+    size_t len;
+} numa_slice;
+
+static void *numa_touch(void *arg) {
+    numa_slice *s = (numa_slice *)arg;
+    for (char *p = s->start; p < s->start + s->len; p += page_size()) {
+        *(volatile char *)p = 0;
+    }
+    return NULL;
+}
+
+// Binds a node heap to its node's memory. Where mbind is missing or not
+// allowed, the pages are faulted in from a thread pinned to the node's CPUs
+// instead, so first touch still puts them on the right node.
+static void numa_place(char *start, size_t len, int node, int index) {
+    if (node < 64) {
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_mbind, start, len, NUMA_MPOL_BIND, &mask, sizeof(mask) * 8 + 1, 0) == 0) {
+            return;
+        }
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (numa_cpu_node[cpu] == index) {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    numa_slice slice = {start, len};
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    if (pthread_create(&thread, &attr, numa_touch, &slice) == 0) {
+        pthread_join(thread, NULL);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Lays out one heap of span bytes per node, each with its arena in front
+// like umem_arena_create. The first node's heap belongs to main_arena.
+static void numa_open(size_t span, int allocationAlgo, int *ids, int nodes) {
+    size_t offset = (sizeof(umem_arena) + 63) / 64 * 64;
+    numa_stride = ALIGN_UP(offset + span + HEADER_SIZE, page_size());
+    numa_base = map_region(numa_stride * nodes);
+
+    for (int i = 0; i < nodes; i++) {
+        char *slice = numa_base + i * numa_stride;
+        numa_place(slice, numa_stride, ids[i], i);
+        umem_arena *a = &main_arena;
+        if (i > 0) {
+            a = (umem_arena *)slice;
+            pthread_mutex_init(&a->lock, NULL);
+        }
+        a->map_size = numa_stride;
+        arena_open(a, slice + offset, span, allocationAlgo);
+        numa_arenas[i] = a;
+    }
+    numa_nodes = nodes;
+}
+
+int umeminit(size_t sizeOfRegion, int allocationAlgo) {
+    umem_arena *a = &main_arena;
+    if (a->head != NULL || a->buddy_base != NULL || sizeOfRegion <= 0) {
+        return -1;
+    }
+
+    // Buddy mates are found relative to one base, so a buddy heap can't grow
+    if ((allocationAlgo & UMEM_GROW) && (allocationAlgo & ALGO_MASK) == BUDDY) {
+        return -1;
+    }
+
+    // Node heaps are told apart by address, which grown chunks would break
+    if ((allocationAlgo & UMEM_GROW) && (allocationAlgo & UMEM_NUMA)) {
+        return -1;
     }
-    
-    // Coalesce with previous block if free
-    block *prev = head;
-    while (prev && prev->next != current) {
-        prev = prev->next;
+
+    size_t span = heap_span(sizeOfRegion, allocationAlgo & ALGO_MASK);
+    if (span == 0) {
+        return -1;
     }
-    if (prev && prev->free) {
-        prev->size += current->size + HEADER_SIZE;
-        prev->next = current->next;
+
+    // On a single node this is just the ordinary heap
+    int ids[NUMA_MAX_NODES];
+    int nodes = (allocationAlgo & UMEM_NUMA) ? numa_discover(ids) : 0;
+    if (nodes > 1) {
+        numa_open(span, allocationAlgo, ids, nodes);
+        return 0;
     }
-    
+
+    // The extra header is the fence that ends the block chain
+    a->map_size = span + HEADER_SIZE;
+    arena_open(a, map_region(a->map_size), span, allocationAlgo);
     return 0;
 }
 
-void umemdump() {
-    block *current = head;
-    printf("Memory Dump:\n");
-    while (current) {
-        printf("%p: %zu bytes (%s)\n", (void *)((char *)current + HEADER_SIZE), current->size - HEADER_SIZE, current->free ? "free" : "allocated");
-        current = current->next;
+umem_arena *umem_arena_create(size_t sizeOfRegion, int allocationAlgo) {
+    if (sizeOfRegion <= 0) {
+        return NULL;
     }
-    printf("\n");
-}
\ No newline at end of file
+    if ((allocationAlgo & UMEM_GROW) && (allocationAlgo & ALGO_MASK) == BUDDY) {
+        return NULL;
+    }
+
+    size_t span = heap_span(sizeOfRegion, allocationAlgo & ALGO_MASK);
+    if (span == 0) {
+        return NULL;
+    }
+
+    // The arena itself sits in front of its heap in the same mapping
+    size_t offset = (sizeof(umem_arena) + 63) / 64 * 64;
+    size_t bytes = offset + span + HEADER_SIZE;
+    umem_arena *a = (umem_arena *)map_region(bytes);
+    pthread_mutex_init(&a->lock, NULL);
+    a->map_size = bytes;
+    arena_open(a, (char *)a + offset, span, allocationAlgo);
+    return a;
+}
+
+static void chunks_unmap(chunk **list) {
+    while (*list) {
+        chunk *c = *list;
+        *list = c->next;
+        munmap(c, c->map_size);
+    }
+}
+
+int umem_arena_destroy(umem_arena *a) {
+    if (a == NULL || a == &main_arena) {
+        return -1;
+    }
+    // Node heaps live inside the UMEM_NUMA mapping
+    for (int i = 1; i < numa_nodes; i++) {
+        if (a == numa_arenas[i]) {
+            return -1;
+        }
+    }
+    chunks_unmap(&a->chunks);
+    chunks_unmap(&a->large);
+    pthread_mutex_destroy(&a->lock);
+    return munmap(a, a->map_size);
+}
+
+// Maps another chunk big enough for a block of size bytes and files its
+// single free block in the bins. Chunks are at least as big as the
+// original region so growth stays geometric in the number of mappings.
+static int chunk_add(umem_arena *a, size_t size) {
+    size_t bytes = sizeof(chunk) + size + HEADER_SIZE;
+    if (bytes < a->total_size) {
+        bytes = a->total_size;
+    }
+    bytes = (bytes + page_size() - 1) & ~(page_size() - 1);
+
+    void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return -1;
+    }
+
+    chunk *c = (chunk *)ptr;
+    c->map_size = bytes;
+    c->first = (block *)(c + 1);
+    c->prev = NULL;
+    c->next = a->chunks;
+    if (c->next) {
+        c->next->prev = c;
+    }
+    a->chunks = c;
+
+    block *b = c->first;
+    b->size = (bytes - sizeof(chunk) - HEADER_SIZE) | BLOCK_FREE;
+    b->prev = NULL;
+    block *fence = NEXT(b);
+    fence->size = 0;
+    fence->prev = b;
+
+    a->free_bytes += SIZE(b);
+    a->stats.mapped += bytes;
+    bin_insert(a, b);
+    return 0;
+}
+
+// Called with a block that was just freed and coalesced. Whole free chunks
+// are unmapped and a large free tail of the original region has its pages
+// dropped, but only while the arena holds more free memory than the threshold.
+static int trim(umem_arena *a, block *b) {
+    if (a->free_bytes <= a->trim_threshold) {
+        return 0;
+    }
+
+    if (b->prev == NULL && b != a->head && SIZE(NEXT(b)) == 0) {
+        chunk *c = (chunk *)b - 1;
+        bin_remove(a, b);
+        a->free_bytes -= SIZE(b);
+        if (c->prev) {
+            c->prev->next = c->next;
+        } else {
+            a->chunks = c->next;
+        }
+        if (c->next) {
+            c->next->prev = c->prev;
+        }
+        a->stats.mapped -= c->map_size;
+        munmap(c, c->map_size);
+        return 1;
+    }
+
+    if (NEXT(b) == (block *)((char *)a->head + a->total_size) && SIZE(b) >= a->trim_threshold) {
+        // Keep the header and bin links resident, drop whole pages after them.
+        // The page holding the fence is never dropped.
+        char *start = (char *)ALIGN_UP((char *)LINKS(b) + LINK_BYTES, page_size());
+        char *floor = (char *)((size_t)NEXT(b) & ~(page_size() - 1));
+        char *end = (char *)ALIGN_UP(a->untouched, page_size());
+        if (end > floor) {
+            end = floor;
+        }
+        if (start < end) {
+            madvise(start, (size_t)(end - start), MADV_DONTNEED);
+            if (a->untouched <= floor) {
+                a->untouched = start;
+            }
+        }
+    }
+    return 0;
+}
+
+static void stats_take(umem_arena *a, size_t bytes) {
+    a->stats.in_use += bytes;
+    if (a->stats.in_use > a->stats.peak_in_use) {
+        a->stats.peak_in_use = a->stats.in_use;
+    }
+}
+
+// Rounded block size, header included, that the arena hands out for a request
+static size_t request_size(umem_arena *a, size_t size) {
+    // This rounds to the nearest 16 so every payload stays 16-byte aligned
+    size = ALIGN_UP(size + CANARY_SIZE, ALIGNMENT);
+    if (size < MIN_PAYLOAD) {
+        size = MIN_PAYLOAD;
+    }
+    size += HEADER_SIZE;
+
+    if (a->algorithm == BUDDY) {
+        size_t rounded = (size_t)1 << BUDDY_MIN_ORDER;
+        while (rounded < size) {
+            rounded <<= 1;
+        }
+        size = rounded;
+    }
+    return size;
+}
+
+// The backend: size is a rounded block size including the header.
+// Callers in threaded mode hold the arena lock.
+static size_t slab_release_empty(umem_arena *a);
+
+// grow lets a UMEM_GROW arena map a chunk when nothing fits
+static block *heap_take_grow(umem_arena *a, size_t size, int grow) {
+    a->stats.searches++;
+    block *best = bin_find(a, size);
+    if (!best && a->slabs && slab_release_empty(a) > 0) {
+        best = bin_find(a, size);
+    }
+    if (!best && grow && chunk_add(a, size) == 0) {
+        best = bin_find(a, size);
+    }
+    if (!best) {
+        return NULL;
+    }
+
+    bin_remove(a, best);
+    if (a->algorithm == NEXT_FIT) {
+        a->next_fit_ptr = NEXT(best);
+    }
+    return best;
+}
+
+static block *heap_take(umem_arena *a, size_t size) {
+    return heap_take_grow(a, size, a->grow);
+}
+
+// Moves the untouched mark past an allocated block of the base region and
+// the header and links of the block after it
+static void heap_touch(umem_arena *a, block *b) {
+    char *end = (char *)LINKS(NEXT(b)) + LINK_BYTES;
+    if (b >= a->head && (char *)b < (char *)a->head + a->total_size && end > a->untouched) {
+        a->untouched = end;
+    }
+}
+
+// Marks a block taken from the bins as allocated, returning any tail
+// beyond size to the bins.
+static void *heap_carve(umem_arena *a, block *best, size_t size) {
+    if (SIZE(best) >= size + HEADER_SIZE + MIN_PAYLOAD) {
+        block *new_block = (block *)((char *)best + size);
+        new_block->size = (SIZE(best) - size) | BLOCK_FREE;
+        new_block->prev = best;
+        NEXT(new_block)->prev = new_block;
+        best->size = size | (best->size & FLAG_MASK);
+        bin_insert(a, new_block);
+        a->stats.splits++;
+    }
+
+    a->free_bytes -= SIZE(best);
+    stats_take(a, SIZE(best));
+    heap_touch(a, best);
+
+    best->size &= ~BLOCK_FREE;
+    return (void *)((char *)best + HEADER_SIZE);
+}
+
+static void *heap_alloc(umem_arena *a, size_t size) {
+    if (a->algorithm == BUDDY) {
+        void *ptr = buddy_alloc(a, size);
+        if (ptr) {
+            a->free_bytes -= SIZE((block *)((char *)ptr - HEADER_SIZE));
+            stats_take(a, SIZE((block *)((char *)ptr - HEADER_SIZE)));
+        }
+        return ptr;
+    }
+
+    block *best = heap_take(a, size);
+    return best ? heap_carve(a, best, size) : NULL;
+}
+
+// Cuts up to n blocks of size bytes back to back from a block taken from the
+// bins, leaving whatever is over as one free block. Returns how many it cut.
+static size_t heap_carve_run(umem_arena *a, block *b, size_t size, size_t n, void **out) {
+    size_t total = SIZE(b);
+    size_t k = total / size < n ? total / size : n;
+    block *prev = b->prev;
+    char *p = (char *)b;
+    for (size_t i = 0; i < k; i++) {
+        block *x = (block *)p;
+        x->size = size;
+        x->prev = prev;
+        out[i] = (void *)((char *)x + HEADER_SIZE);
+        prev = x;
+        p += size;
+    }
+
+    size_t rest = total - k * size;
+    if (rest >= HEADER_SIZE + MIN_PAYLOAD) {
+        block *tail = (block *)p;
+        tail->size = rest | BLOCK_FREE;
+        tail->prev = prev;
+        bin_insert(a, tail);
+        prev = tail;
+        a->stats.splits++;
+    } else {
+        // Too small to stand alone, so the last block keeps it
+        prev->size += rest;
+        rest = 0;
+    }
+    NEXT(prev)->prev = prev;
+
+    a->free_bytes -= total - rest;
+    stats_take(a, total - rest);
+    a->stats.splits += k - 1;
+    heap_touch(a, (block *)((char *)out[k - 1] - HEADER_SIZE));
+    return k;
+}
+
+// Places a payload skew bytes past an alignment boundary above ALIGNMENT.
+// Fit heaps split the padding in front off as a free block of its own; a
+// buddy block can't be split that way, so a shifted header in front of the
+// payload points back at it.
+static void *heap_alloc_aligned(umem_arena *a, size_t size, size_t alignment, size_t skew) {
+    if (a->algorithm == BUDDY) {
+        // Leaves room to skip ahead when the gap can't hold a whole header
+        char *raw = heap_alloc(a, size + alignment + HEADER_SIZE - ALIGNMENT);
+        if (!raw) {
+            return NULL;
+        }
+        char *ptr = (char *)ALIGN_UP(raw - skew, alignment) + skew;
+        if (ptr != raw && (size_t)(ptr - raw) < HEADER_SIZE) {
+            ptr += alignment;
+        }
+        if (ptr != raw) {
+            block *shifted = (block *)(ptr - HEADER_SIZE);
+            shifted->size = BLOCK_SHIFTED;
+            shifted->prev = (block *)(raw - HEADER_SIZE);
+        }
+        return ptr;
+    }
+
+    // Worst case the lead gap is too small to be a block and we skip ahead once more
+    block *b = heap_take(a, size + alignment + HEADER_SIZE + MIN_PAYLOAD);
+    if (!b) {
+        return NULL;
+    }
+
+    char *payload = (char *)b + HEADER_SIZE;
+    char *aligned = (char *)ALIGN_UP(payload - skew, alignment) + skew;
+    if (aligned != payload && (size_t)(aligned - payload) < HEADER_SIZE + MIN_PAYLOAD) {
+        aligned += alignment;
+    }
+
+    if (aligned != payload) {
+        size_t lead = (size_t)(aligned - payload);
+        block *moved = (block *)((char *)b + lead);
+        moved->size = SIZE(b) - lead;
+        moved->prev = b;
+        NEXT(moved)->prev = moved;
+        // The block before b is never free, so the lead stands on its own
+        b->size = lead | BLOCK_FREE;
+        bin_insert(a, b);
+        a->stats.splits++;
+        b = moved;
+    }
+    return heap_carve(a, b, size);
+}
+
+static int heap_free(umem_arena *a, block *current) {
+    if (IS_FREE(current)) {
+        return -1;
+    }
+    current->size &= SIZE_MASK;
+    a->free_bytes += SIZE(current);
+    a->stats.in_use -= SIZE(current);
+
+    if (a->algorithm == BUDDY) {
+        buddy_release(a, (char *)current + HEADER_SIZE);
+        return 0;
+    }
+
+    // Coalesce with next block if free
+    block *next = NEXT(current);
+    if (IS_FREE(next)) {
+        bin_remove(a, next);
+        current->size += SIZE(next);
+        a->stats.coalesces++;
+    }
+
+    // Coalesce with previous block if free. Bins of the address policies are
+    // ordered by address, so a block that grows within its bin keeps its place
+    // and only the sizes above it need refreshing.
+    block *prev = current->prev;
+    if (prev && IS_FREE(prev)) {
+        size_t idx = bin_index(SIZE(prev));
+        size_t merged = SIZE(prev) + SIZE(current);
+        a->stats.coalesces++;
+        if ((a->algorithm == FIRST_FIT || a->algorithm == NEXT_FIT) && bin_index(merged) == idx) {
+            prev->size += SIZE(current);
+            NEXT(prev)->prev = prev;
+            node_grown(a, a->bins[idx], prev);
+            if (a->grow) {
+                trim(a, prev);
+            }
+            return 0;
+        }
+        bin_remove(a, prev);
+        prev->size += SIZE(current);
+        current = prev;
+    }
+
+    current->size |= BLOCK_FREE;
+    NEXT(current)->prev = current;
+    bin_insert(a, current);
+    if (a->grow) {
+        trim(a, current);
+    }
+    return 0;
+}
+
+// The slab table is an open addressed set of slab base addresses, itself
+// allocated from the heap. Consecutive slabs hash to consecutive slots.
+static size_t slab_slot(umem_arena *a, char *base) {
+    size_t i = ((size_t)base >> SLAB_SHIFT) & (a->slab_cap - 1);
+    while (a->slab_table[i] && a->slab_table[i] != base) {
+        i = (i + 1) & (a->slab_cap - 1);
+    }
+    return i;
+}
+
+static slab *slab_find(umem_arena *a, void *ptr) {
+    if (a->slab_count == 0) {
+        return NULL;
+    }
+    char *base = (char *)((size_t)ptr & ~(SLAB_SIZE - 1));
+    return a->slab_table[slab_slot(a, base)] ? SLAB_OF(base) : NULL;
+}
+
+static int slab_table_add(umem_arena *a, char *base) {
+    if ((a->slab_count + 1) * 2 > a->slab_cap) {
+        size_t cap = a->slab_cap ? a->slab_cap * 2 : 64;
+        char **table = heap_alloc(a, request_size(a, cap * sizeof(char *)));
+        if (!table) {
+            return -1;
+        }
+        memset(table, 0, cap * sizeof(char *));
+
+        char **old = a->slab_table;
+        size_t old_cap = a->slab_cap;
+        a->slab_table = table;
+        a->slab_cap = cap;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i]) {
+                a->slab_table[slab_slot(a, old[i])] = old[i];
+            }
+        }
+        if (old) {
+            heap_free(a, (block *)((char *)old - HEADER_SIZE));
+        }
+    }
+    a->slab_table[slab_slot(a, base)] = base;
+    a->slab_count++;
+    return 0;
+}
+
+static void slab_table_remove(umem_arena *a, char *base) {
+    size_t i = slab_slot(a, base);
+    a->slab_table[i] = NULL;
+    a->slab_count--;
+
+    // Shift later entries of the probe run back so lookups never stop early
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & (a->slab_cap - 1);
+        if (!a->slab_table[j]) {
+            break;
+        }
+        size_t home = ((size_t)a->slab_table[j] >> SLAB_SHIFT) & (a->slab_cap - 1);
+        if (((j - home) & (a->slab_cap - 1)) >= ((j - i) & (a->slab_cap - 1))) {
+            a->slab_table[i] = a->slab_table[j];
+            a->slab_table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+static void slab_link(umem_arena *a, slab *s) {
+    s->prev = NULL;
+    s->next = a->slab_partial[s->cls];
+    if (s->next) {
+        s->next->prev = s;
+    }
+    a->slab_partial[s->cls] = s;
+}
+
+static void slab_unlink(umem_arena *a, slab *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        a->slab_partial[s->cls] = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+}
+
+static slab *slab_new(umem_arena *a, unsigned cls) {
+    // A whole SLAB_SIZE block, header included, so neighbouring slabs tile
+    void *ptr = heap_alloc_aligned(a, SLAB_SIZE, SLAB_SIZE, HEADER_SIZE);
+    if (!ptr) {
+        return NULL;
+    }
+    slab *s = (slab *)ptr;
+    if (slab_table_add(a, SLAB_BASE(s)) != 0) {
+        heap_free(a, (block *)SLAB_BASE(s));
+        return NULL;
+    }
+
+    s->free_list = NULL;
+    s->bump = SLAB_OBJECTS(s);
+    s->obj_size = (cls + 1) * ALIGNMENT;
+    s->used = 0;
+    s->capacity = (unsigned)((SLAB_SIZE - (size_t)(SLAB_OBJECTS(s) - SLAB_BASE(s))) / s->obj_size);
+    s->cls = cls;
+#ifdef UMEM_DEBUG
+    memset(s->live, 0, sizeof(s->live));
+#endif
+    slab_link(a, s);
+    return s;
+}
+
+// Returns NULL when no slab can be made so the caller can use the heap instead
+static void *slab_alloc(umem_arena *a, size_t size) {
+    unsigned cls = (unsigned)(ALIGN_UP(size, ALIGNMENT) / ALIGNMENT) - 1;
+    slab *s = a->slab_partial[cls];
+    if (!s) {
+        s = slab_new(a, cls);
+        if (!s) {
+            return NULL;
+        }
+    } else if (s->used == 0) {
+        a->slab_empty--;
+    }
+
+    void *obj;
+    if (s->free_list) {
+        obj = s->free_list;
+        s->free_list = *(void **)obj;
+    } else {
+        // Slots past the bump pointer have never been handed out
+        obj = s->bump;
+        s->bump += s->obj_size;
+    }
+#ifdef UMEM_DEBUG
+    size_t slot = (size_t)((char *)obj - SLAB_OBJECTS(s)) / s->obj_size;
+    s->live[slot / 8] |= (unsigned char)(1 << (slot % 8));
+#endif
+
+    if (++s->used == s->capacity) {
+        slab_unlink(a, s);
+    }
+    return obj;
+}
+
+static void slab_drop(umem_arena *a, slab *s) {
+    slab_unlink(a, s);
+    slab_table_remove(a, SLAB_BASE(s));
+    heap_free(a, (block *)SLAB_BASE(s));
+}
+
+// Returns -1 for a pointer no slot of s can have handed out: s is empty or
+// the pointer lies past every slot cut so far
+static int slab_free(umem_arena *a, slab *s, void *ptr) {
+    if (s->used == 0 || (char *)ptr < SLAB_OBJECTS(s) || (char *)ptr >= s->bump) {
+        return -1;
+    }
+#ifdef UMEM_DEBUG
+    size_t slot = (size_t)((char *)ptr - SLAB_OBJECTS(s)) / s->obj_size;
+    s->live[slot / 8] &= (unsigned char)~(1 << (slot % 8));
+#endif
+    *(void **)ptr = s->free_list;
+    s->free_list = ptr;
+
+    if (s->used-- == s->capacity) {
+        slab_link(a, s);
+    }
+
+    // Keep one empty slab per class around so a lone object can't make us thrash
+    if (s->used == 0 && (s->prev || s->next)) {
+        slab_drop(a, s);
+    } else if (s->used == 0) {
+        a->slab_empty++;
+    }
+    return 0;
+}
+
+// Gives the empty slabs the classes keep back to the heap, for when the heap
+// has run out; returns how many there were
+static size_t slab_release_empty(umem_arena *a) {
+    size_t released = 0;
+    for (unsigned cls = 0; cls < SLAB_CLASSES && a->slab_empty; cls++) {
+        slab *s = a->slab_partial[cls];
+        while (s) {
+            slab *next = s->next;
+            if (s->used == 0) {
+                slab_drop(a, s);
+                a->slab_empty--;
+                released++;
+            }
+            s = next;
+        }
+    }
+    return released;
+}
+
+static int arena_release(umem_arena *a, void *ptr);
+
+// Hands a chain of cached blocks, linked through their payload, back to
+// the backend under a single lock acquisition.
+static void cache_flush_chain(block *chain) {
+    if (!chain) {
+        return;
+    }
+    pthread_mutex_lock(&main_arena.lock);
+    while (chain) {
+        block *next = LINKS(chain)->next;
+        heap_free(&main_arena, chain);
+        chain = next;
+    }
+    pthread_mutex_unlock(&main_arena.lock);
+}
+
+static void cache_release(void *arg) {
+    tcache *tc = (tcache *)arg;
+    for (size_t c = 0; c < TCACHE_CLASSES; c++) {
+        cache_flush_chain(tc->bin[c]);
+        tc->bin[c] = NULL;
+        tc->count[c] = 0;
+    }
+    // Close the remote stack so late cross-thread frees go to the backend
+    cache_flush_chain(atomic_exchange(&tc->remote, REMOTE_CLOSED));
+    atomic_store(&tc->live, 0);
+}
+
+static void cache_key_init(void) {
+    pthread_key_create(&cache_key, cache_release);
+}
+
+// Claims a cache slot for the calling thread, or returns NULL when every
+// slot is taken and the thread has to go straight to the backend.
+static tcache *cache_get(void) {
+    if (cache_id >= 0) {
+        return &caches[cache_id];
+    }
+    pthread_once(&cache_once, cache_key_init);
+    for (int i = 0; i < MAX_THREADS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&caches[i].live, &expected, 1)) {
+            atomic_store(&caches[i].remote, NULL);
+            cache_id = i;
+            pthread_setspecific(cache_key, &caches[i]);
+            return &caches[i];
+        }
+    }
+    return NULL;
+}
+
+// Only the owning thread writes a counter, so no read-modify-write is needed
+static void cache_count(atomic_size_t *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+static void cache_push(tcache *tc, block *b) {
+    if (SIZE(b) > TCACHE_LIMIT) {
+        LINKS(b)->next = NULL;
+        cache_flush_chain(b);
+        return;
+    }
+
+    size_t c = SIZE(b) / ALIGNMENT;
+    LINKS(b)->next = tc->bin[c];
+    tc->bin[c] = b;
+    tc->count[c]++;
+
+    // Keep the bin bounded by returning a batch to the backend
+    if (tc->count[c] >= TCACHE_CAP) {
+        block *chain = tc->bin[c];
+        block *last = chain;
+        for (int i = 1; i < TCACHE_BATCH; i++) {
+            last = LINKS(last)->next;
+        }
+        tc->bin[c] = LINKS(last)->next;
+        tc->count[c] -= TCACHE_BATCH;
+        LINKS(last)->next = NULL;
+        cache_flush_chain(chain);
+    }
+}
+
+static void cache_drain_remote(tcache *tc) {
+    block *b = atomic_exchange(&tc->remote, NULL);
+    while (b) {
+        block *next = LINKS(b)->next;
+        cache_push(tc, b);
+        b = next;
+    }
+}
+
+static void *cache_alloc(tcache *tc, size_t size) {
+    size_t c = size / ALIGNMENT;
+    if (!tc->bin[c] && atomic_load_explicit(&tc->remote, memory_order_relaxed)) {
+        cache_drain_remote(tc);
+    }
+
+    if (!tc->bin[c]) {
+        // Refill a batch under one lock acquisition
+        size_t owner = (size_t)(tc - caches) + 1;
+        pthread_mutex_lock(&main_arena.lock);
+        for (int i = 0; i < TCACHE_BATCH; i++) {
+            void *ptr = heap_alloc(&main_arena, size);
+            if (!ptr) {
+                break;
+            }
+            block *b = (block *)((char *)ptr - HEADER_SIZE);
+            if (SIZE(b) != size) {
+                // Unsplit leftovers belong to another class; hand them out directly
+                b->size |= owner << OWNER_SHIFT;
+                pthread_mutex_unlock(&main_arena.lock);
+                return ptr;
+            }
+            b->size |= owner << OWNER_SHIFT;
+            LINKS(b)->next = tc->bin[c];
+            tc->bin[c] = b;
+            tc->count[c]++;
+        }
+        if (!tc->bin[c]) {
+            main_arena.stats.failures++;
+        }
+        pthread_mutex_unlock(&main_arena.lock);
+        if (!tc->bin[c]) {
+            return NULL;
+        }
+    }
+
+    block *b = tc->bin[c];
+    tc->bin[c] = LINKS(b)->next;
+    tc->count[c]--;
+    return (void *)((char *)b + HEADER_SIZE);
+}
+
+static int cache_free(block *b) {
+    size_t owner = OWNER(b);
+    tcache *tc = owner ? cache_get() : NULL;
+
+    if (tc && owner == (size_t)(tc - caches) + 1) {
+        cache_push(tc, b);
+        cache_count(&tc->frees);
+        return 0;
+    }
+
+    if (owner) {
+        // Cross-thread free: the owner picks it up on its next refill
+        tcache *home = &caches[owner - 1];
+        block *top = atomic_load(&home->remote);
+        while (top != REMOTE_CLOSED) {
+            LINKS(b)->next = top;
+            if (atomic_compare_exchange_weak(&home->remote, &top, b)) {
+                break;
+            }
+        }
+        if (top != REMOTE_CLOSED) {
+            if (tc) {
+                cache_count(&tc->frees);
+            } else {
+                // Every cache slot is taken, so the arena counts it
+                pthread_mutex_lock(&main_arena.lock);
+                main_arena.stats.frees++;
+                pthread_mutex_unlock(&main_arena.lock);
+            }
+            return 0;
+        }
+    }
+
+    return arena_release(&main_arena, (char *)b + HEADER_SIZE);
+}
+
+// Maps bytes for a large object. With UMEM_HUGEPAGES big mappings first try
+// explicit huge pages, then fall back to a huge-page-aligned normal mapping
+// that transparent huge pages can back.
+static void *large_map(umem_arena *a, size_t *bytes) {
+    void *ptr;
+    if (!a->hugepages || *bytes < HUGE_PAGE_SIZE) {
+        ptr = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+    size_t huge = (*bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+    ptr = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        *bytes = huge;
+        return ptr;
+    }
+#endif
+
+    // Over-map so a huge-page-aligned start can be cut out of it
+    char *raw = mmap(NULL, huge + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *start = (char *)(((size_t)raw + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1));
+    if (start > raw) {
+        munmap(raw, (size_t)(start - raw));
+    }
+    munmap(start + huge, (size_t)(raw + HUGE_PAGE_SIZE - start));
+#ifdef MADV_HUGEPAGE
+    madvise(start, huge, MADV_HUGEPAGE);
+#endif
+    *bytes = huge;
+    return start;
+}
+
+// The block header of a large object points back at its chunk through prev
+static void *large_alloc(umem_arena *a, size_t size, size_t alignment) {
+    size_t bytes = sizeof(chunk) + HEADER_SIZE + size + CANARY_SIZE;
+    if (alignment > ALIGNMENT) {
+        bytes += alignment;
+    }
+    bytes = ALIGN_UP(bytes, page_size());
+
+    chunk *c = large_map(a, &bytes);
+    if (!c) {
+        if (a->threaded) {
+            pthread_mutex_lock(&a->lock);
+        }
+        a->stats.failures++;
+        if (a->threaded) {
+            pthread_mutex_unlock(&a->lock);
+        }
+        return NULL;
+    }
+    c->map_size = bytes;
+
+    char *payload = (char *)ALIGN_UP((char *)(c + 1) + HEADER_SIZE, alignment);
+    block *b = (block *)(payload - HEADER_SIZE);
+    b->size = (size_t)((char *)c + bytes - (char *)b) | BLOCK_LARGE;
+    b->prev = (block *)c;
+    c->first = b;
+
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    c->prev = NULL;
+    c->next = a->large;
+    if (c->next) {
+        c->next->prev = c;
+    }
+    a->large = c;
+    a->stats.allocs++;
+    a->stats.mapped += bytes;
+    stats_take(a, bytes);
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    return (void *)((char *)b + HEADER_SIZE);
+}
+
+static int large_free(umem_arena *a, block *b) {
+    chunk *c = (chunk *)b->prev;
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        a->large = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    a->stats.frees++;
+    a->stats.mapped -= c->map_size;
+    a->stats.in_use -= c->map_size;
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    return munmap(c, c->map_size);
+}
+
+#ifdef UMEM_DEBUG
+static void debug_fail(const char *what, void *ptr) {
+    fprintf(stderr, "umem: %s at %p\n", what, ptr);
+    abort();
+}
+
+// Stamps a block that is about to be handed out
+static void *debug_live(void *ptr, size_t size) {
+    if (ptr) {
+        block *h = (block *)((char *)ptr - HEADER_SIZE);
+        size_t canary = CANARY ^ (size_t)ptr;
+        h->magic = MAGIC_LIVE ^ (size_t)h;
+        h->request = size;
+        memcpy((char *)ptr + size, &canary, CANARY_SIZE);
+    }
+    return ptr;
+}
+
+// Aborts unless ptr is a live block with its canary intact
+static void debug_verify(void *ptr) {
+    block *h = (block *)((char *)ptr - HEADER_SIZE);
+    if ((size_t)ptr % ALIGNMENT != 0) {
+        debug_fail("misaligned pointer", ptr);
+    }
+    if (h->magic == (MAGIC_FREED ^ (size_t)h)) {
+        debug_fail("double free", ptr);
+    }
+    if (h->magic != (MAGIC_LIVE ^ (size_t)h)) {
+        debug_fail("pointer not from umem", ptr);
+    }
+    size_t canary;
+    memcpy(&canary, (char *)ptr + h->request, CANARY_SIZE);
+    if (canary != (CANARY ^ (size_t)ptr)) {
+        debug_fail("write past end of block", ptr);
+    }
+}
+
+// Slab objects have no header, so their slot's live bit is checked instead
+static int debug_is_slab(umem_arena *a, void *ptr) {
+    if (!a->slabs) {
+        return 0;
+    }
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    slab *s = slab_find(a, ptr);
+    const char *what = NULL;
+    if (s) {
+        size_t offset = (size_t)((char *)ptr - SLAB_OBJECTS(s));
+        size_t slot = offset / s->obj_size;
+        if ((char *)ptr < SLAB_OBJECTS(s) || (char *)ptr >= s->bump || offset % s->obj_size != 0) {
+            what = "pointer not from umem";
+        } else if (!(s->live[slot / 8] & (1 << (slot % 8)))) {
+            what = "double free";
+        }
+    }
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    if (what) {
+        debug_fail(what, ptr);
+    }
+    return s != NULL;
+}
+
+// Checks a freed block and marks it freed. One in QUARANTINE_SAMPLE is also
+// poisoned and parked in the quarantine, and the block that falls out of it
+// is returned to be freed for real; the rest go straight through, as do slab
+// objects. The sample is counted per arena, so a fresh arena always holds
+// back the same frees.
+static void *debug_free(umem_arena *a, void *ptr) {
+    if (!ptr || debug_is_slab(a, ptr)) {
+        return ptr;
+    }
+    debug_verify(ptr);
+    block *h = (block *)((char *)ptr - HEADER_SIZE);
+    h->magic = MAGIC_FREED ^ (size_t)h;
+    if ((atomic_fetch_add_explicit(&a->quarantine_tick, 1, memory_order_relaxed) + 1) % QUARANTINE_SAMPLE != 0) {
+        return ptr;
+    }
+    size_t poison = h->request < POISON_BYTES ? h->request : POISON_BYTES;
+    memset(ptr, POISON, poison);
+
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    void *old = a->quarantine[a->quarantine_next];
+    a->quarantine[a->quarantine_next] = ptr;
+    a->quarantine_next = (a->quarantine_next + 1) % QUARANTINE;
+    if (!old) {
+        // Nothing reaches the backend to be counted, so this free counts here
+        a->stats.frees++;
+    }
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    if (old) {
+        block *oh = (block *)((char *)old - HEADER_SIZE);
+        size_t n = oh->request < POISON_BYTES ? oh->request : POISON_BYTES;
+        for (size_t i = 0; i < n; i++) {
+            if (((unsigned char *)old)[i] != POISON) {
+                debug_fail("write after free", old);
+            }
+        }
+    }
+    return old;
+}
+#else
+static inline void *debug_live(void *ptr, size_t size) {
+    (void)size;
+    return ptr;
+}
+
+static inline void debug_verify(void *ptr) {
+    (void)ptr;
+}
+
+static inline void *debug_free(umem_arena *a, void *ptr) {
+    (void)a;
+    return ptr;
+}
+#endif
+
+// Also reports how many leading payload bytes may be non-zero: new mappings
+// and blocks cut from untouched heap are zero past their free links.
+static void *arena_alloc(umem_arena *a, size_t size, size_t *dirty) {
+    if (a == NULL || (a->head == NULL && a->buddy_base == NULL) || size == 0) {
+        return NULL;
+    }
+    if (a->mmap_threshold && size >= a->mmap_threshold) {
+        *dirty = 0;
+        return debug_live(large_alloc(a, size, ALIGNMENT), size);
+    }
+    size_t bytes = request_size(a, size);
+
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    void *ptr = NULL;
+    *dirty = size;
+    if (a->slabs && size <= SLAB_MAX) {
+        ptr = slab_alloc(a, size);
+    }
+    int slabbed = ptr != NULL;
+    if (!ptr) {
+        char *untouched = a->untouched;
+        ptr = heap_alloc(a, bytes);
+        if (ptr && a->algorithm != BUDDY) {
+            block *b = (block *)((char *)ptr - HEADER_SIZE);
+            if (b >= a->head && (char *)b < (char *)a->head + a->total_size && (char *)LINKS(b) + LINK_BYTES >= untouched) {
+                *dirty = LINK_BYTES < size ? LINK_BYTES : size;
+            }
+        }
+    }
+    if (ptr) {
+        a->stats.allocs++;
+    } else {
+        a->stats.failures++;
+    }
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    return slabbed ? ptr : debug_live(ptr, size);
+}
+
+void *arena_malloc(umem_arena *a, size_t size) {
+    size_t dirty;
+    return arena_alloc(a, size, &dirty);
+}
+
+void *arena_calloc(umem_arena *a, size_t n, size_t size) {
+    if (size && n > (size_t)-1 / size) {
+        return NULL;
+    }
+    size_t dirty;
+    void *ptr = arena_alloc(a, n * size, &dirty);
+    if (ptr) {
+        memset(ptr, 0, dirty);
+    }
+    return ptr;
+}
+
+static int arena_release(umem_arena *a, void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+
+    // Slab objects have no header, so they have to be ruled out first
+    if (a->slabs) {
+        if (a->threaded) {
+            pthread_mutex_lock(&a->lock);
+        }
+        slab *s = slab_find(a, ptr);
+        int rc = s ? slab_free(a, s, ptr) : 0;
+        if (s && rc == 0) {
+            a->stats.frees++;
+        }
+        if (a->threaded) {
+            pthread_mutex_unlock(&a->lock);
+        }
+        if (s) {
+            return rc;
+        }
+    }
+
+    block *current = (block *)((char *)ptr - HEADER_SIZE);
+    if (current->size & BLOCK_SHIFTED) {
+        current = current->prev;
+    }
+    if (current->size & BLOCK_LARGE) {
+        return large_free(a, current);
+    }
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    int rc = heap_free(a, current);
+    if (rc == 0) {
+        a->stats.frees++;
+    }
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    return rc;
+}
+
+int arena_free(umem_arena *a, void *ptr) {
+    return arena_release(a, debug_free(a, ptr));
+}
+
+size_t arena_malloc_batch(umem_arena *a, size_t size, size_t n, void **out) {
+    if (a == NULL || (a->head == NULL && a->buddy_base == NULL) || size == 0 || out == NULL) {
+        return 0;
+    }
+    size_t got = 0;
+    if (a->mmap_threshold && size >= a->mmap_threshold) {
+        while (got < n && (out[got] = debug_live(large_alloc(a, size, ALIGNMENT), size)) != NULL) {
+            got++;
+        }
+        return got;
+    }
+    size_t bytes = request_size(a, size);
+
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    if (a->slabs && size <= SLAB_MAX) {
+        while (got < n && (out[got] = slab_alloc(a, size)) != NULL) {
+            got++;
+        }
+    }
+    size_t slabbed = got;
+    if (a->algorithm == BUDDY) {
+        while (got < n && (out[got] = heap_alloc(a, bytes)) != NULL) {
+            got++;
+        }
+    } else if (got < n) {
+        // One block for the whole batch if there is one, otherwise as many
+        // objects as each fitting block holds. The free space already there
+        // goes first; a growing arena only maps a chunk for what is left.
+        for (int grow = 0; grow <= a->grow && got < n; grow++) {
+            size_t want = n - got;
+            block *b = want > 1 && bytes <= (size_t)-1 / want ? heap_take_grow(a, bytes * want, grow) : NULL;
+            while (got < n && (b || (b = heap_take_grow(a, bytes, grow)) != NULL)) {
+                got += heap_carve_run(a, b, bytes, n - got, out + got);
+                b = NULL;
+            }
+        }
+    }
+    a->stats.allocs += got;
+    if (got < n) {
+        a->stats.failures++;
+    }
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    for (size_t i = slabbed; i < got; i++) {
+        debug_live(out[i], size);
+    }
+    return got;
+}
+
+static int compare_ptr(const void *x, const void *y) {
+    char *p = *(char *const *)x;
+    char *q = *(char *const *)y;
+    return (p > q) - (p < q);
+}
+
+// Sorting puts neighbouring blocks next to each other, so each run of them
+// is joined into one block and freed with a single coalesce.
+int arena_free_batch(umem_arena *a, void **ptrs, size_t n) {
+    if (a == NULL || ptrs == NULL) {
+        return -1;
+    }
+#ifdef UMEM_DEBUG
+    // Batches skip the quarantine, but every block is still checked
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] && !debug_is_slab(a, ptrs[i])) {
+            debug_verify(ptrs[i]);
+            block *h = (block *)((char *)ptrs[i] - HEADER_SIZE);
+            h->magic = MAGIC_FREED ^ (size_t)h;
+        }
+    }
+#endif
+    qsort(ptrs, n, sizeof(void *), compare_ptr);
+
+    int rc = 0;
+    size_t large = 0;
+    void *last = NULL;
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!ptrs[i]) {
+            continue;
+        }
+        if (ptrs[i] == last) {
+            rc = -1;
+            continue;
+        }
+        last = ptrs[i];
+        slab *s = a->slabs ? slab_find(a, ptrs[i]) : NULL;
+        if (s) {
+            if (slab_free(a, s, ptrs[i]) == 0) {
+                a->stats.frees++;
+            } else {
+                rc = -1;
+            }
+            continue;
+        }
+
+        block *run = (block *)((char *)ptrs[i] - HEADER_SIZE);
+        if (run->size & BLOCK_SHIFTED) {
+            run = run->prev;
+        }
+        if (run->size & BLOCK_LARGE) {
+            // Moved to the front and unmapped once the lock is dropped
+            ptrs[i] = ptrs[large];
+            ptrs[large++] = last;
+            continue;
+        }
+        if (IS_FREE(run)) {
+            rc = -1;
+            continue;
+        }
+
+        size_t count = 1;
+        if (a->algorithm != BUDDY) {
+            while (i + 1 < n && (block *)((char *)ptrs[i + 1] - HEADER_SIZE) == NEXT(run)) {
+                block *next = NEXT(run);
+                if (SIZE(next) == 0 || (next->size & FLAG_MASK)) {
+                    break;
+                }
+                run->size += SIZE(next);
+                a->stats.coalesces++;
+                count++;
+                last = ptrs[++i];
+            }
+            NEXT(run)->prev = run;
+        }
+        if (heap_free(a, run) == 0) {
+            a->stats.frees += count;
+        } else {
+            rc = -1;
+        }
+    }
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    for (size_t i = 0; i < large; i++) {
+        large_free(a, (block *)((char *)ptrs[i] - HEADER_SIZE));
+    }
+    return rc;
+}
+
+void *arena_memalign(umem_arena *a, size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return arena_malloc(a, size);
+    }
+    if (a == NULL || (a->head == NULL && a->buddy_base == NULL) || size == 0) {
+        return NULL;
+    }
+    if (a->mmap_threshold && size >= a->mmap_threshold) {
+        return debug_live(large_alloc(a, size, alignment), size);
+    }
+    size_t bytes = request_size(a, size);
+
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    void *ptr = heap_alloc_aligned(a, bytes, alignment, 0);
+    if (ptr) {
+        a->stats.allocs++;
+    } else {
+        a->stats.failures++;
+    }
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    return debug_live(ptr, size);
+}
+
+// Resizes an allocated heap block to a rounded size without moving it.
+// Fit heaps take in a free next block to grow and give back the tail to
+// shrink; buddy blocks can only shrink, by handing back upper halves.
+static int heap_resize(umem_arena *a, block *b, size_t size) {
+    if (a->algorithm == BUDDY) {
+        size_t order = __builtin_ctzl(SIZE(b));
+        if (size > SIZE(b)) {
+            return -1;
+        }
+        while (order > BUDDY_MIN_ORDER && ((size_t)1 << (order - 1)) >= size) {
+            order--;
+            // The lower half stays allocated, so the upper one can't merge
+            buddy_push(a, (block *)((char *)b + ((size_t)1 << order)), order);
+            a->free_bytes += (size_t)1 << order;
+            a->stats.in_use -= (size_t)1 << order;
+            a->stats.splits++;
+        }
+        b->size = ((size_t)1 << order) | (b->size & ~SIZE_MASK);
+        return 0;
+    }
+
+    size_t old = SIZE(b);
+    if (size > old) {
+        block *next = NEXT(b);
+        if (!IS_FREE(next) || old + SIZE(next) < size) {
+            return -1;
+        }
+        bin_remove(a, next);
+        a->stats.coalesces++;
+        b->size += SIZE(next);
+        NEXT(b)->prev = b;
+    }
+
+    block *tail = NULL;
+    if (SIZE(b) >= size + HEADER_SIZE + MIN_PAYLOAD) {
+        tail = (block *)((char *)b + size);
+        tail->size = SIZE(b) - size;
+        tail->prev = b;
+        b->size -= SIZE(tail);
+        a->stats.splits++;
+    }
+
+    // Only the net change counts, so peak_in_use never sees the absorbed block whole
+    if (SIZE(b) > old) {
+        a->free_bytes -= SIZE(b) - old;
+        stats_take(a, SIZE(b) - old);
+    } else {
+        a->free_bytes += old - SIZE(b);
+        a->stats.in_use -= old - SIZE(b);
+    }
+
+    if (tail) {
+        block *next = NEXT(tail);
+        if (IS_FREE(next)) {
+            bin_remove(a, next);
+            tail->size += SIZE(next);
+            a->stats.coalesces++;
+        }
+        NEXT(tail)->prev = tail;
+        tail->size |= BLOCK_FREE;
+        bin_insert(a, tail);
+        if (a->grow) {
+            trim(a, tail);
+        }
+    }
+    heap_touch(a, b);
+    return 0;
+}
+
+// Shrinking a large block unmaps the pages past its new end
+static void large_shrink(umem_arena *a, block *b, size_t size) {
+    chunk *c = (chunk *)b->prev;
+    size_t keep = ALIGN_UP((char *)b + HEADER_SIZE + size - (char *)c, page_size());
+    if (keep < c->map_size && munmap((char *)c + keep, c->map_size - keep) == 0) {
+        a->stats.mapped -= c->map_size - keep;
+        a->stats.in_use -= c->map_size - keep;
+        c->map_size = keep;
+        b->size = (size_t)((char *)c + keep - (char *)b) | BLOCK_LARGE;
+    }
+}
+
+// Tries to fit size bytes at ptr where it is. Otherwise reports how many
+// payload bytes ptr has, so the caller knows how much to copy.
+static int resize_in_place(umem_arena *a, void *ptr, size_t size, size_t *usable) {
+    int done = 0;
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+
+    slab *s = a->slabs ? slab_find(a, ptr) : NULL;
+    block *b = (block *)((char *)ptr - HEADER_SIZE);
+    if (!s) {
+        debug_verify(ptr);
+    }
+    if (s) {
+        *usable = s->obj_size;
+        done = size <= *usable;
+    } else if (b->size & BLOCK_SHIFTED) {
+        *usable = (size_t)((char *)b->prev + SIZE(b->prev) - (char *)ptr);
+        done = size + CANARY_SIZE <= *usable;
+    } else if (b->size & BLOCK_LARGE) {
+        *usable = SIZE(b) - HEADER_SIZE;
+        if (size + CANARY_SIZE <= *usable) {
+            large_shrink(a, b, size + CANARY_SIZE);
+            done = 1;
+        }
+    } else {
+        *usable = SIZE(b) - HEADER_SIZE;
+        done = heap_resize(a, b, request_size(a, size)) == 0;
+    }
+
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    if (done && !s) {
+        debug_live(ptr, size);
+    }
+    return done;
+}
+
+void *arena_realloc(umem_arena *a, void *ptr, size_t size) {
+    if (!ptr) {
+        return arena_malloc(a, size);
+    }
+    if (size == 0) {
+        arena_free(a, ptr);
+        return NULL;
+    }
+
+    size_t usable;
+    if (resize_in_place(a, ptr, size, &usable)) {
+        return ptr;
+    }
+    void *fresh = arena_malloc(a, size);
+    if (fresh) {
+        memcpy(fresh, ptr, usable < size ? usable : size);
+        arena_free(a, ptr);
+    }
+    return fresh;
+}
+
+void arena_reset(umem_arena *a) {
+    if (a == NULL || a == &main_arena) {
+        // main_arena blocks may be sitting in thread caches
+        return;
+    }
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    chunks_unmap(&a->chunks);
+    chunks_unmap(&a->large);
+    arena_format(a);
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+// A write that fails for any reason but a signal ends the trace, so the
+// buffer is dropped rather than left full for the next event to overrun
+static int trace_flush(void) {
+    size_t done = 0;
+    while (done < trace_len) {
+        ssize_t n = write(trace_fd, trace_buf + done, trace_len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            atomic_store(&tracing, 0);
+            close(trace_fd);
+            trace_fd = -1;
+            trace_len = 0;
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    trace_len = 0;
+    return 0;
+}
+
+// extra is the alignment of TRACE_MEMALIGN and the old pointer of TRACE_REALLOC
+static void trace_event(int op, void *ptr, size_t size, size_t extra) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    if (trace_len + TRACE_RECORD_MAX > sizeof(trace_buf) && trace_flush() != 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    unsigned char *p = trace_buf + trace_len;
+    *p++ = (unsigned char)op;
+    p = trace_put(p, trace_zigzag((long long)((size_t)ptr - trace_last_ptr)));
+    p = trace_put(p, (unsigned long long)(now - trace_last_ns));
+    if (op != TRACE_FREE) {
+        p = trace_put(p, size);
+    }
+    if (op == TRACE_MEMALIGN) {
+        p = trace_put(p, extra);
+    } else if (op == TRACE_REALLOC) {
+        p = trace_put(p, trace_zigzag((long long)(extra - (size_t)ptr)));
+    }
+    trace_len = (size_t)(p - trace_buf);
+    trace_last_ptr = (size_t)ptr;
+    trace_last_ns = now;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int umem_trace_start(const char *path) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace_last_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    trace_last_ptr = 0;
+    memcpy(trace_buf, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    trace_len = TRACE_MAGIC_LEN;
+    atomic_store(&tracing, 1);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+int umem_trace_stop(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    atomic_store(&tracing, 0);
+    // A failed flush has already closed the file
+    int rc = trace_flush();
+    if (rc == 0) {
+        rc = close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return rc;
+}
+
+// The heap a request of size bytes is served from: the calling thread's
+// node under UMEM_NUMA, except that large objects all go to main_arena.
+// Their pages are first touched by the caller, so they land locally anyway.
+static umem_arena *main_home(size_t size) {
+    if (numa_nodes > 1 && !(main_arena.mmap_threshold && size >= main_arena.mmap_threshold)) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && cpu < NUMA_MAX_CPUS) {
+            return numa_arenas[numa_cpu_node[cpu]];
+        }
+    }
+    return &main_arena;
+}
+
+// The heap ptr came from. Anything outside the node heaps is a large object.
+static umem_arena *main_owner(void *ptr) {
+    size_t offset = (size_t)((char *)ptr - numa_base);
+    if (numa_nodes > 1 && offset < numa_stride * numa_nodes) {
+        return numa_arenas[offset / numa_stride];
+    }
+    return &main_arena;
+}
+
+// umalloc and ufree without the tracing, so urealloc is logged as one call.
+// Thread caches only serve a single main_arena, so UMEM_NUMA goes without.
+static void *main_malloc(size_t size) {
+    umem_arena *a = main_home(size);
+    if ((a->head == NULL && a->buddy_base == NULL) || size == 0) {
+        return NULL;
+    }
+
+    size_t bytes = request_size(a, size);
+    if (a->threaded && !a->slabs && numa_nodes == 1 && bytes <= TCACHE_LIMIT) {
+        tcache *tc = cache_get();
+        if (tc) {
+            void *ptr = cache_alloc(tc, bytes);
+            if (ptr) {
+                cache_count(&tc->allocs);
+            }
+            return debug_live(ptr, size);
+        }
+    }
+    return arena_malloc(a, size);
+}
+
+static int main_free(void *ptr) {
+    umem_arena *a = main_owner(ptr);
+    ptr = debug_free(a, ptr);
+    if (!ptr) {
+        return 0;
+    }
+    if (a->threaded && !a->slabs && numa_nodes == 1) {
+        return cache_free((block *)((char *)ptr - HEADER_SIZE));
+    }
+    return arena_release(a, ptr);
+}
+
+void *umalloc(size_t size) {
+    void *ptr = main_malloc(size);
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        trace_event(TRACE_ALLOC, ptr, size, 0);
+    }
+    return ptr;
+}
+
+int ufree(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+
+    // Logged first so a racing umalloc of the same block can't come before it
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        trace_event(TRACE_FREE, ptr, 0, 0);
+    }
+    return main_free(ptr);
+}
+
+void *urealloc(void *ptr, size_t size) {
+    void *fresh = NULL;
+    size_t usable;
+    if (!ptr) {
+        fresh = main_malloc(size);
+    } else if (size == 0) {
+        main_free(ptr);
+    } else if (resize_in_place(main_owner(ptr), ptr, size, &usable)) {
+        fresh = ptr;
+    } else {
+        fresh = main_malloc(size);
+        if (fresh) {
+            memcpy(fresh, ptr, usable < size ? usable : size);
+            main_free(ptr);
+        }
+    }
+
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        trace_event(TRACE_REALLOC, fresh, size, (size_t)ptr);
+    }
+    return fresh;
+}
+
+// A debug build only offers the bytes asked for, since the canary follows them
+size_t arena_usable_size(umem_arena *a, void *ptr) {
+    if (a == NULL || ptr == NULL) {
+        return 0;
+    }
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    slab *s = a->slabs ? slab_find(a, ptr) : NULL;
+    block *b = (block *)((char *)ptr - HEADER_SIZE);
+    size_t usable;
+    if (s) {
+        usable = s->obj_size;
+    } else {
+        debug_verify(ptr);
+#ifdef UMEM_DEBUG
+        usable = b->request;
+#else
+        if (b->size & BLOCK_SHIFTED) {
+            usable = (size_t)((char *)b->prev + SIZE(b->prev) - (char *)ptr);
+        } else {
+            usable = SIZE(b) - HEADER_SIZE;
+        }
+#endif
+    }
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    return usable;
+}
+
+size_t umem_usable_size(void *ptr) {
+    return ptr ? arena_usable_size(main_owner(ptr), ptr) : 0;
+}
+
+// Bypasses the thread caches, whose blocks are never known to be clean
+void *ucalloc(size_t n, size_t size) {
+    void *ptr = arena_calloc(main_home(n * size), n, size);
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        trace_event(TRACE_CALLOC, ptr, n * size, 0);
+    }
+    return ptr;
+}
+
+// Batches skip the thread caches and go to the arena under one lock
+size_t umalloc_batch(size_t size, size_t n, void **out) {
+    size_t got = arena_malloc_batch(main_home(size), size, n, out);
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        for (size_t i = 0; i < got; i++) {
+            trace_event(TRACE_ALLOC, out[i], size, 0);
+        }
+    }
+    return got;
+}
+
+int ufree_batch(void **ptrs, size_t n) {
+    if (ptrs && atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        for (size_t i = 0; i < n; i++) {
+            if (ptrs[i]) {
+                trace_event(TRACE_FREE, ptrs[i], 0, 0);
+            }
+        }
+    }
+    if (numa_nodes == 1 || ptrs == NULL) {
+        return arena_free_batch(&main_arena, ptrs, n);
+    }
+
+    // Sorted, the pointers of each node heap form one run
+    qsort(ptrs, n, sizeof(void *), compare_ptr);
+    int rc = 0;
+    size_t i = 0;
+    while (i < n) {
+        umem_arena *a = main_owner(ptrs[i]);
+        size_t j = i + 1;
+        while (j < n && main_owner(ptrs[j]) == a) {
+            j++;
+        }
+        if (arena_free_batch(a, ptrs + i, j - i) != 0) {
+            rc = -1;
+        }
+        i = j;
+    }
+    return rc;
+}
+
+void *umemalign(size_t alignment, size_t size) {
+    void *ptr = arena_memalign(main_home(size), alignment, size);
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        trace_event(TRACE_MEMALIGN, ptr, size, alignment);
+    }
+    return ptr;
+}
+
+void arena_dump(umem_arena *a) {
+    block *current = a->head;
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    printf("Memory Dump:\n");
+    if (a->algorithm == BUDDY) {
+        // Buddy blocks tile the region, so walk them by address
+        char *p = a->buddy_base;
+        while (p && p < a->buddy_base + a->total_size) {
+            block *b = (block *)p;
+            printf("%p: %zu bytes (%s)\n", (void *)(p + HEADER_SIZE), SIZE(b) - HEADER_SIZE, IS_FREE(b) ? "free" : "allocated");
+            p += SIZE(b);
+        }
+    }
+    chunk *c = a->chunks;
+    while (a->algorithm != BUDDY && current) {
+        if (SIZE(current) == 0) {
+            // Fence: carry on with the next grown chunk
+            current = c ? c->first : NULL;
+            c = c ? c->next : NULL;
+            continue;
+        }
+        printf("%p: %zu bytes (%s)\n", (void *)((char *)current + HEADER_SIZE), SIZE(current) - HEADER_SIZE, IS_FREE(current) ? "free" : "allocated");
+        current = NEXT(current);
+    }
+    for (c = a->large; c; c = c->next) {
+        printf("%p: %zu bytes (mapped)\n", (void *)((char *)c->first + HEADER_SIZE), SIZE(c->first) - HEADER_SIZE);
+    }
+    printf("\n");
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+void umemdump() {
+    for (int i = 0; i < numa_nodes; i++) {
+        arena_dump(numa_arenas[i]);
+    }
+}
+
+static int check_fail(const char *what, void *at) {
+    fprintf(stderr, "umem check: %s at %p\n", what, at);
+    return -1;
+}
+
+// Walks one block chain up to its fence, counting the free blocks
+static int check_chain(block *b, char *limit, size_t *nfree, size_t *free_sum) {
+    block *prev = NULL;
+    for (; SIZE(b) != 0; prev = b, b = NEXT(b)) {
+        if (b->prev != prev) {
+            return check_fail("broken prev link", b);
+        }
+        if (SIZE(b) < HEADER_SIZE + MIN_PAYLOAD || SIZE(b) % ALIGNMENT != 0 || (char *)NEXT(b) + HEADER_SIZE > limit) {
+            return check_fail("bad block size", b);
+        }
+        if (IS_FREE(b)) {
+            if (prev && IS_FREE(prev)) {
+                return check_fail("free blocks not coalesced", b);
+            }
+            (*nfree)++;
+            *free_sum += SIZE(b);
+        }
+#ifdef UMEM_DEBUG
+        else if (b->magic == (MAGIC_LIVE ^ (size_t)b)) {
+            size_t canary;
+            memcpy(&canary, (char *)b + HEADER_SIZE + b->request, CANARY_SIZE);
+            if (canary != (CANARY ^ (size_t)((char *)b + HEADER_SIZE))) {
+                return check_fail("write past end of block", (char *)b + HEADER_SIZE);
+            }
+        }
+#endif
+    }
+    if (b->prev != prev) {
+        return check_fail("broken prev link", b);
+    }
+    return 0;
+}
+
+// Checks one bin's tree: order within the bounds, heap priorities, and the
+// largest sizes kept by range bin blocks
+static int check_bin(umem_arena *a, block *t, size_t idx, block *lo, block *hi, size_t *binned) {
+    if (!t) {
+        return 0;
+    }
+    if (!IS_FREE(t) || bin_index(SIZE(t)) != idx) {
+        return check_fail("bad block in bin", t);
+    }
+    block *left = NODE(t)->left;
+    block *right = NODE(t)->right;
+    if ((lo && !bin_before(a, lo, t)) || (hi && !bin_before(a, t, hi))
+        || (left && bin_priority(left) > bin_priority(t)) || (right && bin_priority(right) > bin_priority(t))) {
+        return check_fail("broken bin tree", t);
+    }
+    if (SIZE(t) >= SMALL_LIMIT) {
+        size_t max = NODE(t)->max;
+        node_update(t);
+        if (NODE(t)->max != max) {
+            return check_fail("stale largest size in bin", t);
+        }
+    }
+    (*binned)++;
+    if (check_bin(a, left, idx, lo, t, binned) != 0) {
+        return -1;
+    }
+    return check_bin(a, right, idx, t, hi, binned);
+}
+
+static int check_heap(umem_arena *a) {
+    size_t nfree = 0, free_sum = 0, binned = 0;
+
+    if (a->algorithm == BUDDY) {
+        for (char *p = a->buddy_base; p < a->buddy_base + a->total_size; p += SIZE((block *)p)) {
+            size_t size = SIZE((block *)p);
+            if (size < ((size_t)1 << BUDDY_MIN_ORDER) || (size & (size - 1)) != 0 || (size_t)(p - a->buddy_base) % size != 0) {
+                return check_fail("bad buddy block", p);
+            }
+            if (IS_FREE((block *)p)) {
+                nfree++;
+                free_sum += size;
+            }
+        }
+        for (size_t k = 0; k <= BUDDY_MAX_ORDER; k++) {
+            for (block *b = a->buddy_free[k]; b; b = LINKS(b)->next) {
+                if (!IS_FREE(b) || SIZE(b) != ((size_t)1 << k)) {
+                    return check_fail("bad block on buddy free list", b);
+                }
+                binned++;
+            }
+        }
+    } else {
+        if (check_chain(a->head, (char *)a->head + a->total_size + HEADER_SIZE, &nfree, &free_sum) != 0) {
+            return -1;
+        }
+        for (chunk *c = a->chunks; c; c = c->next) {
+            if (check_chain(c->first, (char *)c + c->map_size, &nfree, &free_sum) != 0) {
+                return -1;
+            }
+        }
+        for (size_t idx = 0; idx < NBINS; idx++) {
+            int marked = (a->bin_map[idx / 64] >> (idx % 64)) & 1;
+            int summary = (a->bin_summary >> (idx / 64)) & 1;
+            if (marked != (a->bins[idx] != NULL) || summary != (a->bin_map[idx / 64] != 0)) {
+                return check_fail("bin bitmap out of date", a->bins[idx]);
+            }
+            if (bin_listed(a, idx)) {
+                for (block *b = a->bins[idx]; b; b = LINKS(b)->next) {
+                    if (!IS_FREE(b) || bin_index(SIZE(b)) != idx) {
+                        return check_fail("bad block in bin", b);
+                    }
+                    if (LINKS(b)->next && LINKS(LINKS(b)->next)->prev != b) {
+                        return check_fail("broken bin link", b);
+                    }
+                    binned++;
+                }
+                if (a->bin_first[idx] != a->bins[idx]) {
+                    return check_fail("stale first block of bin", a->bin_first[idx]);
+                }
+                continue;
+            }
+            if (check_bin(a, a->bins[idx], idx, NULL, NULL, &binned) != 0) {
+                return -1;
+            }
+            block *t = a->bins[idx];
+            while (t && NODE(t)->left) {
+                t = NODE(t)->left;
+            }
+            if (a->bin_first[idx] != t) {
+                return check_fail("stale first block of bin", a->bin_first[idx]);
+            }
+        }
+    }
+
+    if (binned != nfree) {
+        return check_fail("free blocks missing from the bins", a);
+    }
+    if (free_sum != a->free_bytes) {
+        return check_fail("free byte count is off", a);
+    }
+    for (chunk *c = a->large; c; c = c->next) {
+        if (!(c->first->size & BLOCK_LARGE) || (chunk *)c->first->prev != c) {
+            return check_fail("bad large block", (char *)c->first + HEADER_SIZE);
+        }
+    }
+    return 0;
+}
+
+// Checks every block, link and counter of the arena; reports the first
+// problem on stderr and returns -1.
+int arena_check(umem_arena *a) {
+    if (a == NULL || (a->head == NULL && a->buddy_base == NULL)) {
+        return -1;
+    }
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    int rc = check_heap(a);
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    return rc;
+}
+
+int umem_check(void) {
+    int rc = 0;
+    for (int i = 0; i < numa_nodes; i++) {
+        if (arena_check(numa_arenas[i]) != 0) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+int umem_numa_nodes(void) {
+    return numa_nodes;
+}
+
+// The trace lock is taken first and dropped last; no path holds it while
+// waiting for a heap lock
+void umem_fork_prepare(void) {
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0; i < numa_nodes; i++) {
+        pthread_mutex_lock(&numa_arenas[i]->lock);
+    }
+}
+
+void umem_fork_parent(void) {
+    for (int i = numa_nodes; i-- > 0;) {
+        pthread_mutex_unlock(&numa_arenas[i]->lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Blocks in other threads' caches are lost to the child, as their threads are.
+// The trace file and its buffer belong to the parent, so the child stops tracing.
+void umem_fork_child(void) {
+    for (int i = 0; i < numa_nodes; i++) {
+        pthread_mutex_init(&numa_arenas[i]->lock, NULL);
+    }
+    pthread_mutex_init(&trace_lock, NULL);
+    if (trace_fd >= 0) {
+        atomic_store(&tracing, 0);
+        close(trace_fd);
+        trace_fd = -1;
+        trace_len = 0;
+    }
+}
+
+void arena_set_trim_threshold(umem_arena *a, size_t threshold) {
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    a->trim_threshold = threshold;
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+void umem_set_trim_threshold(size_t threshold) {
+    for (int i = 0; i < numa_nodes; i++) {
+        arena_set_trim_threshold(numa_arenas[i], threshold);
+    }
+}
+
+void arena_set_mmap_threshold(umem_arena *a, size_t threshold) {
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    a->mmap_threshold = threshold;
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+void umem_set_mmap_threshold(size_t threshold) {
+    for (int i = 0; i < numa_nodes; i++) {
+        arena_set_mmap_threshold(numa_arenas[i], threshold);
+    }
+}
+
+// Largest free block: the top non-empty bin's root keeps its largest size, so
+// this is O(1) apart from the bitmap scan; buddy heaps walk down the orders
+static size_t largest_free(umem_arena *a) {
+    if (a->algorithm == BUDDY) {
+        for (size_t k = a->buddy_top + 1; k-- > BUDDY_MIN_ORDER;) {
+            if (a->buddy_free[k]) {
+                return (size_t)1 << k;
+            }
+        }
+        return 0;
+    }
+
+    size_t idx = bin_last(a);
+    return idx < NBINS ? node_max(a->bins[idx]) : 0;
+}
+
+static void stats_derive(umem_stats *stats) {
+    stats->fragmentation = stats->free_bytes ? 1.0 - (double)stats->largest_free / stats->free_bytes : 0.0;
+    stats->probes_per_search = stats->searches ? (double)stats->probes / stats->searches : 0.0;
+}
+
+int arena_stats(umem_arena *a, umem_stats *stats) {
+    if (a == NULL || stats == NULL || (a->head == NULL && a->buddy_base == NULL)) {
+        return -1;
+    }
+    if (a->threaded) {
+        pthread_mutex_lock(&a->lock);
+    }
+    *stats = a->stats;
+    stats->free_bytes = a->free_bytes;
+    stats->largest_free = largest_free(a);
+    if (a->threaded) {
+        pthread_mutex_unlock(&a->lock);
+    }
+    if (a == &main_arena) {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            stats->allocs += atomic_load_explicit(&caches[i].allocs, memory_order_relaxed);
+            stats->frees += atomic_load_explicit(&caches[i].frees, memory_order_relaxed);
+        }
+    }
+
+    stats_derive(stats);
+    return 0;
+}
+
+// Under UMEM_NUMA the node heaps are added up. peak_in_use becomes the sum
+// of the node peaks, which may not all have been reached at once.
+int umemstats(umem_stats *stats) {
+    if (arena_stats(&main_arena, stats) != 0) {
+        return -1;
+    }
+    for (int i = 1; i < numa_nodes; i++) {
+        umem_stats s;
+        arena_stats(numa_arenas[i], &s);
+        stats->in_use += s.in_use;
+        stats->peak_in_use += s.peak_in_use;
+        stats->free_bytes += s.free_bytes;
+        if (s.largest_free > stats->largest_free) {
+            stats->largest_free = s.largest_free;
+        }
+        stats->mapped += s.mapped;
+        stats->allocs += s.allocs;
+        stats->frees += s.frees;
+        stats->failures += s.failures;
+        stats->searches += s.searches;
+        stats->probes += s.probes;
+        stats->splits += s.splits;
+        stats->coalesces += s.coalesces;
+    }
+    stats_derive(stats);
+    return 0;
+}
+
+static void stats_json(const umem_stats *s, FILE *out) {
+    fprintf(out, "{\"in_use\": %zu, \"peak_in_use\": %zu, \"free_bytes\": %zu, \"largest_free\": %zu, "
+            "\"mapped\": %zu, \"fragmentation\": %.4f, \"allocs\": %zu, \"frees\": %zu, \"failures\": %zu, "
+            "\"searches\": %zu, \"probes\": %zu, \"probes_per_search\": %.2f, \"splits\": %zu, \"coalesces\": %zu}\n",
+            s->in_use, s->peak_in_use, s->free_bytes, s->largest_free, s->mapped, s->fragmentation, s->allocs, s->frees,
+            s->failures, s->searches, s->probes, s->probes_per_search, s->splits, s->coalesces);
+}
+
+void arena_stats_json(umem_arena *a, FILE *out) {
+    umem_stats s;
+    if (arena_stats(a, &s) != 0) {
+        fprintf(out, "null\n");
+        return;
+    }
+    stats_json(&s, out);
+}
+
+void umemstats_json(FILE *out) {
+    umem_stats s;
+    if (umemstats(&s) != 0) {
+        fprintf(out, "null\n");
+        return;
+    }
+    stats_json(&s, out);
+}
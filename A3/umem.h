@@ -2,16 +2,118 @@
 #define _UMEM_H
 
 #include <stddef.h>
+#include <stdio.h>
 
 #define BEST_FIT 					(1)
 #define WORST_FIT 					(2)
 #define FIRST_FIT 					(3)
 #define NEXT_FIT 					(4)
 #define BUDDY						(5)
+#define SLAB						(6)
+
+// OR into the algorithm to make umalloc/ufree safe across threads
+#define UMEM_THREADED				(0x100)
+// OR into the algorithm to map more memory instead of failing when full
+#define UMEM_GROW					(0x200)
+// OR into the algorithm to back large mapped blocks with huge pages
+#define UMEM_HUGEPAGES				(0x400)
+// OR into the algorithm to give every NUMA node a heap of sizeOfRegion bytes
+// bound to its memory; umalloc serves each thread from its own node
+#define UMEM_NUMA					(0x800)
 
 int 	umeminit(size_t sizeOfRegion, int allocationAlgo);
 void 	*umalloc(size_t size);
 int 	ufree(void *ptr);
 void 	umemdump();
 
+// urealloc grows into a free neighbour or shrinks where the block is before
+// falling back to a copy. ucalloc only clears memory that may have been used.
+void 	*urealloc(void *ptr, size_t size);
+void 	*ucalloc(size_t n, size_t size);
+
+// Allocates n blocks of size bytes from one search and returns how many it
+// got. ufree_batch sorts ptrs in place so neighbouring blocks coalesce as one.
+size_t 	umalloc_batch(size_t size, size_t n, void **out);
+int 	ufree_batch(void **ptrs, size_t n);
+
+// Payloads are always 16-byte aligned; umemalign takes any power of two
+void 	*umemalign(size_t alignment, size_t size);
+
+// Number of node heaps umeminit made, 1 without UMEM_NUMA or on one node
+int 	umem_numa_nodes(void);
+
+// Payload bytes a live block may use, which can be more than were asked for
+size_t 	umem_usable_size(void *ptr);
+
+// Handlers for pthread_atfork: the global heap's locks are held across fork
+// and start out free in the child
+void 	umem_fork_prepare(void);
+void 	umem_fork_parent(void);
+void 	umem_fork_child(void);
+
+// Independent heaps, each in its own mapping. arena_reset frees every
+// block of an arena at once.
+typedef struct umem_arena umem_arena;
+
+umem_arena 	*umem_arena_create(size_t sizeOfRegion, int allocationAlgo);
+int 		umem_arena_destroy(umem_arena *arena);
+void 		*arena_malloc(umem_arena *arena, size_t size);
+int 		arena_free(umem_arena *arena, void *ptr);
+void 		*arena_realloc(umem_arena *arena, void *ptr, size_t size);
+void 		*arena_calloc(umem_arena *arena, size_t n, size_t size);
+size_t 		arena_malloc_batch(umem_arena *arena, size_t size, size_t n, void **out);
+int 		arena_free_batch(umem_arena *arena, void **ptrs, size_t n);
+void 		*arena_memalign(umem_arena *arena, size_t alignment, size_t size);
+size_t 		arena_usable_size(umem_arena *arena, void *ptr);
+void 		arena_reset(umem_arena *arena);
+void 		arena_dump(umem_arena *arena);
+
+// Growing heaps hand whole free chunks back to the OS once they hold more
+// than this many free bytes (128KB by default).
+void 		umem_set_trim_threshold(size_t threshold);
+void 		arena_set_trim_threshold(umem_arena *arena, size_t threshold);
+
+// Requests of at least this many bytes get a mapping of their own
+// (256KB by default, 0 keeps everything in the heap).
+void 		umem_set_mmap_threshold(size_t threshold);
+void 		arena_set_mmap_threshold(umem_arena *arena, size_t threshold);
+
+// Counters kept up to date by every arena. Byte counts include block headers;
+// blocks served straight from a thread cache never reach the arena and are
+// only seen when the cache refills or flushes.
+typedef struct umem_stats {
+    size_t in_use;              // bytes in allocated blocks and large mappings
+    size_t peak_in_use;
+    size_t free_bytes;
+    size_t largest_free;
+    size_t mapped;              // bytes currently mapped from the OS
+    double fragmentation;       // 1 - largest_free / free_bytes
+    size_t allocs;
+    size_t frees;
+    size_t failures;            // requests the arena could not satisfy
+    size_t searches;            // free list searches by the heap
+    size_t probes;              // free blocks looked at by those searches
+    double probes_per_search;
+    size_t splits;
+    size_t coalesces;
+} umem_stats;
+
+int 		umemstats(umem_stats *stats);
+int 		arena_stats(umem_arena *arena, umem_stats *stats);
+void 		umemstats_json(FILE *out);
+void 		arena_stats_json(umem_arena *arena, FILE *out);
+
+// Walks the whole heap checking every block, link and counter. Prints the
+// first problem to stderr and returns -1. Building umem.c with -DUMEM_DEBUG
+// also adds header magic, tail canaries and a sampled quarantine of freed
+// blocks, and aborts on double frees, foreign pointers and overwrites. That
+// costs about 8% on bench.c rather than the 5% aimed for.
+int 		umem_check(void);
+int 		arena_check(umem_arena *arena);
+
+// Records every umalloc/ufree/umemalign call to a binary trace at path
+// until umem_trace_stop. The replay tool runs it again under any strategy.
+int 		umem_trace_start(const char *path);
+int 		umem_trace_stop(void);
+
 #endif
@@ -1,6 +1,9 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
@@ -9,7 +12,19 @@
 #include <getopt.h>
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+// io_uring is driven through its system calls, so only the kernel header is needed
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>) && defined(STATX_BASIC_STATS)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
 
 #define PATH_MAX 4096
 
@@ -20,29 +35,87 @@ static struct option long_options[] = {
     {"human", no_argument, 0, 'h'},
     {"inode", no_argument, 0, 'i'},
     {"log", required_argument, 0, 'l'},
+    {"recursive", no_argument, 0, 'r'},
+    {"jobs", required_argument, 0, 'j'},
+    {"ordered", no_argument, 0, 'o'},
+    {"index", required_argument, 0, 'x'},
+    {"summary", required_argument, 0, 's'},
+    {"queue-depth", required_argument, 0, 'q'},
+    {"names", no_argument, 0, 'n'},
+    {"fields", required_argument, 0, 'F'},
     {0, 0, 0, 0}
 };
 
-char *formatTime(time_t time, int readable);
-char* getHumanReadableSize(off_t size);
-char* getPermissions(mode_t mode);
+// Fields printed only when asked for, set from the command line before any walk starts
+#define FIELD_NAMES  1   // owner and group names
+#define FIELD_BLOCKS 2   // allocated 512 byte blocks
+#define FIELD_DEVICE 4   // the device holding the file
+#define FIELD_NSEC   8   // nanoseconds on every time
+
+static int printFields;
+
+/* Output buffers
+Entries are formatted straight into a large buffer instead of going through printf, and a
+buffer with a descriptor goes out in one write whenever it fills. A buffer without one (fd -1)
+just grows; the parallel walk fills those and copies them into the stdout buffer when done.
+*/
+#define OUT_BUFFER_SIZE (256 * 1024)
+
+typedef struct outBuffer {
+    char *data;
+    size_t len, cap;
+    int fd;
+    size_t skip;          // bytes still to drop from the front of the stream
+    time_t timeBase;      // last quarter hour outTime broke down, and its fields
+    struct tm timeFields;
+} outBuffer;
+
+void outOpen(outBuffer *ob, int fd);
+void outClose(outBuffer *ob);
+void outFlush(outBuffer *ob);
+void outChars(outBuffer *ob, const char *s, size_t len);
+void outString(outBuffer *ob, const char *s);
+void outJSONString(outBuffer *ob, const char *s);
+void outNumber(outBuffer *ob, long long value);
+void outTime(outBuffer *ob, time_t time, int readable);
+void outSize(outBuffer *ob, off_t size);
+void outPermissions(outBuffer *ob, mode_t mode);
 void listFiles(const char *dirPath, int showInode, int recursive, int readable, int jsonOutput, FILE *logfp);
-void printFileInfo(const char *filePath, int showInode, int humanReadable, int jsonOutput);
+void listFilesParallel(const char *dirPath, int showInode, int recursive, int readable, int jsonOutput, FILE *logfp, int workers, int ordered);
+void listFilesBatched(const char *dirPath, int recursive, int readable, int jsonOutput, FILE *logfp, int depth, int ordered);
+void summarizeTree(const char *dirPath, int readable, int jsonOutput, int workers, int topCount);
+void listChanges(const char *dirPath, const char *indexPath, int recursive, int readable, int jsonOutput, FILE *logfp);
+void printChange(outBuffer *out, const char *change, const char *filePath, struct stat *fileInfo, int readable, int jsonOutput);
+void printFileInfo(outBuffer *out, const char *filePath, int showInode, int humanReadable, int jsonOutput);
+void printStat(outBuffer *out, const char *filePath, struct stat *fileInfo, int humanReadable, int jsonOutput);
+int statEntry(int dirFd, const char *name, int flags, struct stat *fileInfo);
+#ifdef STATX_BASIC_STATS
+// The fields statEntry asks statx for, the ones that get printed
+#define STATX_PRINTED (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_INO \
+                       | STATX_SIZE | STATX_ATIME | STATX_MTIME | STATX_CTIME)
+void statxToStat(const struct statx *stx, struct stat *fileInfo);
+unsigned int statxMask(void);
+#endif
 void printHumanReadableDate(time_t rawtime);
 void printHumanReadableSize(off_t size);
-void printJSONOutput(const char *filePath, struct stat *fileInfo, int readable);
-void printTextOutput(const char *filePath, struct stat *fileInfo, int readable);
+void printJSONOutput(outBuffer *out, const char *filePath, struct stat *fileInfo, int readable);
+void printTextOutput(outBuffer *out, const char *filePath, struct stat *fileInfo, int readable);
 void printUsage(const char *programName);
+const char *userName(uid_t uid);
+const char *groupName(gid_t gid);
 
 int main(int argc, char *argv[]) {
     int opt, option_index = 0;
     int showAll = 0, showInode = 0, log = 0;
     int recursive = 0, human = 0, format = 0;
     int jsonOutput = 0, textOutput = 0;
+    int workers = 1, ordered = 0, summary = 0, queueDepth = 0;
+    char *field, *fieldsLeft;
     char *logFile = NULL;
+    char *indexFile = NULL;
     FILE *logfp = NULL;
 
-    while ((opt = getopt_long(argc, argv, "a?f::hil", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "a?f::hilrj:ox:s:q:nF:", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'i':
                 showInode = 1;
@@ -53,6 +126,52 @@ int main(int argc, char *argv[]) {
             case 'r':
                 recursive = 1;
                 break;
+            case 'j':
+                workers = atoi(optarg);
+                if (workers < 1) {
+                    fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                ordered = 1;
+                break;
+            case 'x':
+                indexFile = optarg;
+                break;
+            case 'n':
+                printFields |= FIELD_NAMES;
+                break;
+            case 'F':
+                for (field = strtok_r(optarg, ",", &fieldsLeft); field != NULL; field = strtok_r(NULL, ",", &fieldsLeft)) {
+                    if (strcmp(field, "names") == 0) {
+                        printFields |= FIELD_NAMES;
+                    } else if (strcmp(field, "blocks") == 0) {
+                        printFields |= FIELD_BLOCKS;
+                    } else if (strcmp(field, "device") == 0) {
+                        printFields |= FIELD_DEVICE;
+                    } else if (strcmp(field, "nsec") == 0) {
+                        printFields |= FIELD_NSEC;
+                    } else {
+                        fprintf(stderr, "Unknown field: %s\n", field);
+                        return 1;
+                    }
+                }
+                break;
+            case 'q':
+                queueDepth = atoi(optarg);
+                if (queueDepth < 1) {
+                    fprintf(stderr, "Invalid queue depth: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                summary = atoi(optarg);
+                if (summary < 1) {
+                    fprintf(stderr, "Invalid summary count: %s\n", optarg);
+                    return 1;
+                }
+                break;
             case 'h':
                 human = 1;
                 break;
@@ -115,7 +234,17 @@ int main(int argc, char *argv[]) {
          if (logfp != NULL) {
             fprintf(logfp, "Listing files in directory: %s\n", dirPath);
         }
-        listFiles(dirPath, showInode, recursive, human, jsonOutput, logfp);
+        if (summary > 0) {
+            summarizeTree(dirPath, human, jsonOutput, workers, summary);
+        } else if (indexFile != NULL) {
+            listChanges(dirPath, indexFile, recursive, human, jsonOutput, logfp);
+        } else if (workers > 1) {
+            listFilesParallel(dirPath, showInode, recursive, human, jsonOutput, logfp, workers, ordered);
+        } else if (queueDepth > 0) {
+            listFilesBatched(dirPath, recursive, human, jsonOutput, logfp, queueDepth, ordered);
+        } else {
+            listFiles(dirPath, showInode, recursive, human, jsonOutput, logfp);
+        }
     } else {
         if (optind >= argc) {
             printUsage(argv[0]);
@@ -124,7 +253,14 @@ int main(int argc, char *argv[]) {
         if (logfp != NULL) {
             fprintf(logfp, "Inspecting file: %s\n", argv[optind]);
         }
-        printFileInfo(argv[optind], showInode, human, jsonOutput);
+        outBuffer out;
+        fflush(stdout);
+        outOpen(&out, STDOUT_FILENO);
+        printFileInfo(&out, argv[optind], showInode, human, jsonOutput);
+        if (jsonOutput) {
+            outChars(&out, "\n", 1);
+        }
+        outClose(&out);
     }
     if (logfp != NULL) {
         fclose(logfp);
@@ -134,124 +270,2185 @@ int main(int argc, char *argv[]) {
 }
 
 
-void listFiles(const char *dirPath, int showInode, int recursive, int readable, int jsonOutput, FILE *logfp) {
-    DIR *dir;
+// Copies "dirPath/" into filePath and returns its length, so each entry's
+// path is the name copied in after it
+static size_t pathPrefix(char *filePath, const char *dirPath) {
+    size_t base = strlen(dirPath);
+    if (base > PATH_MAX - 2) {
+        base = PATH_MAX - 2;
+    }
+    memcpy(filePath, dirPath, base);
+    filePath[base++] = '/';
+    return base;
+}
+
+// Appends name to the "dir/" prefix in filePath, or reports that it does not fit
+static int joinPath(char *filePath, size_t base, const char *name, size_t len) {
+    if (base + len >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %.*s%.*s\n", (int)base, filePath, (int)len, name);
+        return 0;
+    }
+    memcpy(filePath + base, name, len);
+    filePath[base + len] = '\0';
+    return 1;
+}
+
+// Whether the entry name of dirFd, of type dType from readdir, is a directory to descend into
+static int isWalkable(int dirFd, const char *name, unsigned char dType, int statOk, struct stat *fileInfo) {
+    if (dType != DT_UNKNOWN) {
+        return dType == DT_DIR;
+    }
+    // No d_type from this filesystem: descend into real directories, not links to them
+    struct stat linkInfo;
+    return statOk && S_ISDIR(fileInfo->st_mode) && fstatat(dirFd, name, &linkInfo, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(linkInfo.st_mode);
+}
+
+// Puts the entry's path in filePath after the "dir/" prefix and logs it; returns 0 if the
+// path does not fit
+static int startEntry(outBuffer *log, char *filePath, size_t base, const char *name) {
+    size_t len = strlen(name);
+    if (!joinPath(filePath, base, name, len)) {
+        return 0;
+    }
+    if (log != NULL) {
+        outString(log, "Processing file: ");
+        outChars(log, filePath, base + len);
+        outChars(log, "\n", 1);
+    }
+    return 1;
+}
+
+// Prints an entry once it is stat'ed, fileInfo being NULL if that failed with errno, and
+// returns whether it is a directory to descend into
+static int finishEntry(outBuffer *out, int dirFd, const char *name, unsigned char dType, struct stat *fileInfo, const char *filePath, int readable, int jsonOutput) {
+    if (fileInfo != NULL) {
+        // Every object of a listing follows a separator; the first one is skipped
+        if (jsonOutput) {
+            outChars(out, ",\n", 2);
+        }
+        printStat(out, filePath, fileInfo, readable, jsonOutput);
+    } else {
+        perror("Failed to get file stats");
+    }
+    return isWalkable(dirFd, name, dType, fileInfo != NULL, fileInfo);
+}
+
+// Prints one entry of the open directory dirFd and returns whether it is a
+// directory to descend into. The stat is relative to dirFd, so the kernel
+// never resolves the full path again; filePath is only for printing.
+static int printEntry(outBuffer *out, outBuffer *log, int dirFd, struct dirent *entry, char *filePath, size_t base, int readable, int jsonOutput) {
+    if (!startEntry(log, filePath, base, entry->d_name)) {
+        return 0;
+    }
+    struct stat fileInfo;
+    int statOk = statEntry(dirFd, entry->d_name, 0, &fileInfo) == 0;
+    return finishEntry(out, dirFd, entry->d_name, entry->d_type, statOk ? &fileInfo : NULL, filePath, readable, jsonOutput);
+}
+
+// Subdirectories are opened relative to their parent's descriptor
+static void listFilesAt(int parentFd, const char *name, const char *dirPath, int recursive, int readable, int jsonOutput, outBuffer *out, outBuffer *log) {
+    DIR *dir = NULL;
     struct dirent *entry;
 
-    if ((dir = opendir(dirPath)) == NULL) {
+    int fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && (dir = fdopendir(fd)) == NULL) {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    if (dir == NULL) {
         fprintf(stderr, "Error opening directory %s: %s\n", dirPath, strerror(errno));
         return;
     }
 
+    char filePath[PATH_MAX];
+    size_t base = pathPrefix(filePath, dirPath);
     while ((entry = readdir(dir)) != NULL) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
             continue;
 
-        char filePath[PATH_MAX];
-        snprintf(filePath, sizeof(filePath), "%s/%s", dirPath, entry->d_name);
-        if (logfp != NULL) {
-            fprintf(logfp, "Processing file: %s\n", filePath);
+        if (printEntry(out, log, dirfd(dir), entry, filePath, base, readable, jsonOutput) && recursive) {
+            if (!jsonOutput) {
+                outChars(out, "\n", 1);
+            }
+            listFilesAt(dirfd(dir), entry->d_name, filePath, recursive, readable, jsonOutput, out, log);
+        }
+    }
+
+    closedir(dir);
+}
+
+// Points out and log at stdout and the log file, with anything stdio buffered written first.
+// A JSON listing is one array.
+static void beginListing(outBuffer *out, outBuffer *log, FILE *logfp, int jsonOutput) {
+    fflush(stdout);
+    outOpen(out, STDOUT_FILENO);
+    if (jsonOutput) {
+        outChars(out, "[", 1);
+        out->skip = 1;
+    }
+    if (logfp != NULL) {
+        fflush(logfp);
+        outOpen(log, fileno(logfp));
+    }
+}
+
+static void endListing(outBuffer *out, outBuffer *log, FILE *logfp, int jsonOutput) {
+    if (jsonOutput) {
+        outString(out, "\n]\n");
+    }
+    outClose(out);
+    if (logfp != NULL) {
+        outClose(log);
+    }
+}
+
+void listFiles(const char *dirPath, int showInode, int recursive, int readable, int jsonOutput, FILE *logfp) {
+    outBuffer out, log;
+    beginListing(&out, &log, logfp, jsonOutput);
+    listFilesAt(AT_FDCWD, dirPath, dirPath, recursive, readable, jsonOutput, &out, logfp != NULL ? &log : NULL);
+    endListing(&out, &log, logfp, jsonOutput);
+}
+
+/* Batched stats
+With --queue-depth the single threaded walk reads a directory a batch at a time and hands the
+whole batch to a statEngine, which keeps up to that many stats in flight. On Linux they go
+through an io_uring as IORING_OP_STATX requests, so one system call submits the batch and slow
+storage sees them all at once. Where there is no io_uring, or the kernel cannot do statx on
+one, a pool of threads calls statEntry instead. If io_uring_enter fails partway through, the
+ring is drained and the engine carries on with the thread pool. Entries print as their stats
+complete, or in readdir order with --ordered.
+*/
+#define MAX_QUEUE_DEPTH 4096
+#define MAX_STAT_THREADS 64
+
+typedef struct statRequest {
+    int dirFd;
+    const char *name;
+    unsigned char dType;
+    int error;           // errno of a failed stat, or 0
+    struct stat info;
+#ifdef HAVE_IO_URING
+    struct statx stx;
+    int reaped;          // handed back by nextRing
+#endif
+} statRequest;
+
+typedef struct statEngine {
+    statRequest *reqs;   // the batch in flight
+    int count;
+    int depth;
+#ifdef HAVE_IO_URING
+    int ringFd;          // -1 when the thread pool is used
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ringMap, *sqeMap;
+    size_t ringMapSize, sqeMapSize;
+    unsigned pending;    // submitted and not yet reaped
+    int batch;           // size of the batch, count being what is left of it after a fallback
+#endif
+    int numThreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    int next;            // next entry of todo for a thread to take
+    int *todo;           // requests for the threads, by index into reqs
+    int *finished;       // requests in the order they completed
+    int numFinished, taken;
+    int stop;
+} statEngine;
+
+#ifdef HAVE_IO_URING
+static void closeRing(statEngine *e) {
+    if (e->sqeMap != NULL) {
+        munmap(e->sqeMap, e->sqeMapSize);
+    }
+    if (e->ringMap != NULL) {
+        munmap(e->ringMap, e->ringMapSize);
+    }
+    close(e->ringFd);
+    e->ringFd = -1;
+}
+
+// Returns -1 if io_uring_enter fails; whatever it took before that is in flight
+static int submitRing(statEngine *e, statRequest *reqs, int count) {
+    unsigned tail = *e->sqTail;
+    for (int i = 0; i < count; i++) {
+        unsigned slot = tail & *e->sqMask;
+        struct io_uring_sqe *sqe = &e->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = reqs[i].dirFd;
+        sqe->addr = (uintptr_t)reqs[i].name;
+        sqe->len = statxMask();
+        sqe->off = (uintptr_t)&reqs[i].stx;
+        sqe->user_data = i;
+        reqs[i].reaped = 0;
+        e->sqArray[slot] = slot;
+        tail++;
+    }
+    // The kernel reads the entries once it sees the new tail
+    __atomic_store_n(e->sqTail, tail, __ATOMIC_RELEASE);
+    for (int submitted = 0; submitted < count;) {
+        long n = syscall(__NR_io_uring_enter, e->ringFd, count - submitted, 0, 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            e->pending += submitted;
+            return -1;
+        }
+        submitted += n;
+    }
+    e->pending += count;
+    return 0;
+}
+
+// Takes one completion off the ring, or returns 0 if there is none yet
+static int reapRing(statEngine *e, int *index, int *res) {
+    unsigned head = *e->cqHead;
+    if (head == __atomic_load_n(e->cqTail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    struct io_uring_cqe *cqe = &e->cqes[head & *e->cqMask];
+    *index = (int)cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(e->cqHead, head + 1, __ATOMIC_RELEASE);
+    e->pending--;
+    return 1;
+}
+
+// Returns the index of the next completed request, or -1 if io_uring_enter fails
+static int nextRing(statEngine *e) {
+    int i, res;
+    while (!reapRing(e, &i, &res)) {
+        if (syscall(__NR_io_uring_enter, e->ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+    statRequest *r = &e->reqs[i];
+    r->error = res < 0 ? -res : 0;
+    if (res >= 0) {
+        statxToStat(&r->stx, &r->info);
+    }
+    r->reaped = 1;
+    return i;
+}
+
+// Waits out every request the kernel took, since it writes into their statx buffers
+// until it completes them, then closes the ring. Completions still arrive on a ring
+// io_uring_enter has failed on, so this falls back to polling for them.
+static void drainRing(statEngine *e) {
+    int i, res;
+    while (e->pending > 0) {
+        if (reapRing(e, &i, &res)) {
+            continue;
+        }
+        if (syscall(__NR_io_uring_enter, e->ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+    }
+    closeRing(e);
+}
+
+// Sets up a ring of depth entries and stats "." through it, so a kernel without statx
+// on io_uring is found before any real work; returns 0 if the ring is usable
+static int openRing(statEngine *e, int depth) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    e->ringFd = syscall(__NR_io_uring_setup, depth, &params);
+    if (e->ringFd < 0) {
+        return -1;
+    }
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    e->ringMapSize = sqSize > cqSize ? sqSize : cqSize;
+    e->sqeMapSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    // Older kernels map the two rings separately; only the single mapping is used here
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        closeRing(e);
+        return -1;
+    }
+    e->ringMap = mmap(NULL, e->ringMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ringFd, IORING_OFF_SQ_RING);
+    e->sqeMap = mmap(NULL, e->sqeMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ringFd, IORING_OFF_SQES);
+    if (e->ringMap == MAP_FAILED || e->sqeMap == MAP_FAILED) {
+        if (e->ringMap == MAP_FAILED) {
+            e->ringMap = NULL;
+        }
+        if (e->sqeMap == MAP_FAILED) {
+            e->sqeMap = NULL;
+        }
+        closeRing(e);
+        return -1;
+    }
+    char *ring = e->ringMap;
+    e->sqTail = (unsigned *)(ring + params.sq_off.tail);
+    e->sqMask = (unsigned *)(ring + params.sq_off.ring_mask);
+    e->sqArray = (unsigned *)(ring + params.sq_off.array);
+    e->cqHead = (unsigned *)(ring + params.cq_off.head);
+    e->cqTail = (unsigned *)(ring + params.cq_off.tail);
+    e->cqMask = (unsigned *)(ring + params.cq_off.ring_mask);
+    e->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    e->sqes = e->sqeMap;
+
+    statRequest probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.dirFd = AT_FDCWD;
+    probe.name = ".";
+    e->reqs = &probe;
+    int failed = submitRing(e, &probe, 1) != 0 || nextRing(e) < 0;
+    e->reqs = NULL;
+    if (failed || probe.error == EINVAL || probe.error == EOPNOTSUPP) {
+        drainRing(e);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+static void *statWorkerMain(void *arg) {
+    statEngine *e = arg;
+    pthread_mutex_lock(&e->lock);
+    for (;;) {
+        while (!e->stop && e->next >= e->count) {
+            pthread_cond_wait(&e->work, &e->lock);
+        }
+        if (e->stop) {
+            break;
+        }
+        int i = e->todo[e->next++];
+        statRequest *r = &e->reqs[i];
+        pthread_mutex_unlock(&e->lock);
+        r->error = statEntry(r->dirFd, r->name, 0, &r->info) == 0 ? 0 : errno;
+        pthread_mutex_lock(&e->lock);
+        e->finished[e->numFinished++] = i;
+        pthread_cond_signal(&e->done);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+static void openPool(statEngine *e) {
+    e->numThreads = e->depth < MAX_STAT_THREADS ? e->depth : MAX_STAT_THREADS;
+    e->threads = calloc(e->numThreads, sizeof(pthread_t));
+    e->todo = calloc(e->depth, sizeof(int));
+    e->finished = calloc(e->depth, sizeof(int));
+    if (e->threads == NULL || e->todo == NULL || e->finished == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->work, NULL);
+    pthread_cond_init(&e->done, NULL);
+    for (int i = 0; i < e->numThreads; i++) {
+        if (pthread_create(&e->threads[i], NULL, statWorkerMain, e) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+}
+
+static void openStatEngine(statEngine *e, int depth) {
+    memset(e, 0, sizeof(*e));
+    e->depth = depth;
+#ifdef HAVE_IO_URING
+    if (openRing(e, depth) == 0) {
+        return;
+    }
+#endif
+    openPool(e);
+}
+
+#ifdef HAVE_IO_URING
+// Moves a ring that io_uring_enter failed on over to the thread pool. The threads stat
+// every request of the batch nextStat has not handed back yet, including any the ring
+// finished while draining, so the caller still gets each one exactly once.
+static void fallBack(statEngine *e) {
+    perror("io_uring_enter");
+    fprintf(stderr, "Falling back to threads for stats\n");
+    drainRing(e);
+    openPool(e);
+    pthread_mutex_lock(&e->lock);
+    e->next = e->numFinished = e->taken = 0;
+    e->count = 0;
+    for (int i = 0; i < e->batch; i++) {
+        if (!e->reqs[i].reaped) {
+            e->todo[e->count++] = i;
+        }
+    }
+    pthread_cond_broadcast(&e->work);
+    pthread_mutex_unlock(&e->lock);
+}
+#endif
+
+static void closeStatEngine(statEngine *e) {
+#ifdef HAVE_IO_URING
+    if (e->ringFd >= 0) {
+        closeRing(e);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&e->lock);
+    e->stop = 1;
+    pthread_cond_broadcast(&e->work);
+    pthread_mutex_unlock(&e->lock);
+    for (int i = 0; i < e->numThreads; i++) {
+        pthread_join(e->threads[i], NULL);
+    }
+    pthread_cond_destroy(&e->done);
+    pthread_cond_destroy(&e->work);
+    pthread_mutex_destroy(&e->lock);
+    free(e->threads);
+    free(e->todo);
+    free(e->finished);
+}
+
+// Starts stats for all count requests; the previous batch must be finished
+static void submitStats(statEngine *e, statRequest *reqs, int count) {
+#ifdef HAVE_IO_URING
+    if (e->ringFd >= 0) {
+        e->reqs = reqs;
+        e->count = e->batch = count;
+        if (submitRing(e, reqs, count) != 0) {
+            fallBack(e);
+        }
+        return;
+    }
+#endif
+    pthread_mutex_lock(&e->lock);
+    e->reqs = reqs;
+    e->count = count;
+    e->next = e->numFinished = e->taken = 0;
+    for (int i = 0; i < count; i++) {
+        e->todo[i] = i;
+    }
+    pthread_cond_broadcast(&e->work);
+    pthread_mutex_unlock(&e->lock);
+}
+
+// Waits for the next stat of the batch to complete and returns its request's index
+static int nextStat(statEngine *e) {
+#ifdef HAVE_IO_URING
+    if (e->ringFd >= 0) {
+        int i = nextRing(e);
+        if (i >= 0) {
+            return i;
+        }
+        fallBack(e);
+    }
+#endif
+    pthread_mutex_lock(&e->lock);
+    while (e->taken == e->numFinished) {
+        // Rather than sleep while requests are still waiting for a thread, take one
+        if (e->next < e->count) {
+            int i = e->todo[e->next++];
+            pthread_mutex_unlock(&e->lock);
+            e->reqs[i].error = statEntry(e->reqs[i].dirFd, e->reqs[i].name, 0, &e->reqs[i].info) == 0 ? 0 : errno;
+            pthread_mutex_lock(&e->lock);
+            e->finished[e->numFinished++] = i;
+            continue;
+        }
+        pthread_cond_wait(&e->done, &e->lock);
+    }
+    int i = e->finished[e->taken++];
+    pthread_mutex_unlock(&e->lock);
+    return i;
+}
+
+// Prints a request once its stat is done and returns whether to descend into it
+static int finishRequest(statRequest *r, outBuffer *out, outBuffer *log, char *filePath, size_t base, int readable, int jsonOutput) {
+    if (!startEntry(log, filePath, base, r->name)) {
+        return 0;
+    }
+    errno = r->error;
+    return finishEntry(out, r->dirFd, r->name, r->dType, r->error == 0 ? &r->info : NULL, filePath, readable, jsonOutput);
+}
+
+static void listBatchedAt(statEngine *engine, int depth, int ordered, int parentFd, const char *name, const char *dirPath, int recursive, int readable, int jsonOutput, outBuffer *out, outBuffer *log) {
+    DIR *dir = NULL;
+    struct dirent *entry;
+
+    int fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && (dir = fdopendir(fd)) == NULL) {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    if (dir == NULL) {
+        fprintf(stderr, "Error opening directory %s: %s\n", dirPath, strerror(errno));
+        return;
+    }
+
+    // Each level has its own batch, as an ordered walk goes down in the middle of one
+    char filePath[PATH_MAX];
+    size_t base = pathPrefix(filePath, dirPath);
+    statRequest *reqs = malloc(depth * sizeof(statRequest));
+    size_t *nameOffs = malloc(depth * sizeof(size_t));
+    char *walk = malloc(depth);
+    outBuffer names;
+    outOpen(&names, -1);
+    if (reqs == NULL || nameOffs == NULL || walk == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int more = 1;
+    while (more) {
+        int count = 0;
+        names.len = 0;
+        while (count < depth && (more = (entry = readdir(dir)) != NULL)) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            reqs[count].dirFd = dirfd(dir);
+            reqs[count].dType = entry->d_type;
+            nameOffs[count++] = names.len;
+            outChars(&names, entry->d_name, strlen(entry->d_name) + 1);
+        }
+        if (count == 0) {
+            break;
+        }
+        // The names only stay put once the batch is read
+        for (int i = 0; i < count; i++) {
+            reqs[i].name = names.data + nameOffs[i];
+        }
+        submitStats(engine, reqs, count);
+
+        if (ordered) {
+            for (int i = 0; i < count; i++) {
+                nextStat(engine);
+            }
+            for (int i = 0; i < count; i++) {
+                if (finishRequest(&reqs[i], out, log, filePath, base, readable, jsonOutput) && recursive) {
+                    if (!jsonOutput) {
+                        outChars(out, "\n", 1);
+                    }
+                    listBatchedAt(engine, depth, ordered, dirfd(dir), reqs[i].name, filePath, recursive, readable, jsonOutput, out, log);
+                }
+            }
+            continue;
         }
-        printFileInfo(filePath, showInode, readable, jsonOutput);
 
-        if (recursive && entry->d_type == DT_DIR) {
-            printf("\n");
-            listFiles(filePath, showInode, recursive, readable, jsonOutput, logfp);
+        // Unordered, subdirectories wait until the whole batch is in
+        for (int i = 0; i < count; i++) {
+            int done = nextStat(engine);
+            walk[done] = finishRequest(&reqs[done], out, log, filePath, base, readable, jsonOutput) && recursive;
+        }
+        for (int i = 0; i < count; i++) {
+            if (walk[i] && joinPath(filePath, base, reqs[i].name, strlen(reqs[i].name))) {
+                if (!jsonOutput) {
+                    outChars(out, "\n", 1);
+                }
+                listBatchedAt(engine, depth, ordered, dirfd(dir), reqs[i].name, filePath, recursive, readable, jsonOutput, out, log);
+            }
         }
     }
 
+    outClose(&names);
+    free(walk);
+    free(nameOffs);
+    free(reqs);
     closedir(dir);
 }
 
-void printJSONOutput(const char *filePath, struct stat *fileInfo, int readable) {
-    printf("{\n");
-    printf("  \"filePath\": \"%s\",\n", filePath);
-    printf("  \"inode\": {\n");
-    printf("    \"number\": %ld,\n", (long)fileInfo->st_ino);
-    printf("    \"type\": \"%s\",\n", S_ISDIR(fileInfo->st_mode) ? "directory" : (S_ISLNK(fileInfo->st_mode) ? "symbolic link" : "regular file"));
-    printf("    \"permissions\": \"%s\",\n", getPermissions(fileInfo->st_mode));  // Assuming getPermissions() is defined elsewhere
-    printf("    \"linkCount\": %ld,\n", (long)fileInfo->st_nlink);
-    printf("    \"uid\": %d,\n", fileInfo->st_uid);
-    printf("    \"gid\": %d,\n", fileInfo->st_gid);
-    printf("    \"size\": \"%s\",\n", getHumanReadableSize(fileInfo->st_size));
-    printf("    \"accessTime\": \"%s\",\n", formatTime(fileInfo->st_atime, readable));
-    printf("    \"modificationTime\": \"%s\",\n", formatTime(fileInfo->st_mtime, readable));
-    printf("    \"statusChangeTime\": \"%s\"\n", formatTime(fileInfo->st_ctime, readable));
-    printf("  }\n");
-    printf("}");
-}
-
-void printTextOutput(const char *filePath, struct stat *fileInfo, int readable) {
-    printf("File Path: %s\n", filePath);
-    printf("  Inode Number: %ld\n", (long)fileInfo->st_ino);
-    printf("  Type: %s\n", S_ISDIR(fileInfo->st_mode) ? "directory" : (S_ISLNK(fileInfo->st_mode) ? "symbolic link" : "regular file"));
-    printf("  Permissions: %s\n", getPermissions(fileInfo->st_mode));
-    printf("  Link Count: %ld\n", (long)fileInfo->st_nlink);
-    printf("  UID: %d\n", fileInfo->st_uid);
-    printf("  GID: %d\n", fileInfo->st_gid);
-
-    if(readable == 1){printf("  Size: %s\n", getHumanReadableSize(fileInfo->st_size));}
-    else printf("  Size: %lld bytes\n",(fileInfo->st_size));
-    
-    printf("  Access Time: %s\n", formatTime(fileInfo->st_atime, readable));
-    printf("  Modification Time: %s\n", formatTime(fileInfo->st_mtime, readable));
-    printf("  Status Change Time: %s\n", formatTime(fileInfo->st_ctime, readable));
-}
-
-char* getPermissions(mode_t mode) {
-    static char perms[11];
-    perms[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : '-';
-    perms[1] = (mode & S_IRUSR) ? 'r' : '-';
-    perms[2] = (mode & S_IWUSR) ? 'w' : '-';
-    perms[3] = (mode & S_IXUSR) ? 'x' : '-';
-    perms[4] = (mode & S_IRGRP) ? 'r' : '-';
-    perms[5] = (mode & S_IWGRP) ? 'w' : '-';
-    perms[6] = (mode & S_IXGRP) ? 'x' : '-';
-    perms[7] = (mode & S_IROTH) ? 'r' : '-';
-    perms[8] = (mode & S_IWOTH) ? 'w' : '-';
-    perms[9] = (mode & S_IXOTH) ? 'x' : '-';
-    perms[10] = '\0';
+void listFilesBatched(const char *dirPath, int recursive, int readable, int jsonOutput, FILE *logfp, int depth, int ordered) {
+    statEngine engine;
+    outBuffer out, log;
+    if (depth > MAX_QUEUE_DEPTH) {
+        depth = MAX_QUEUE_DEPTH;
+    }
+    openStatEngine(&engine, depth);
+    beginListing(&out, &log, logfp, jsonOutput);
+    listBatchedAt(&engine, depth, ordered, AT_FDCWD, dirPath, dirPath, recursive, readable, jsonOutput, &out, logfp != NULL ? &log : NULL);
+    endListing(&out, &log, logfp, jsonOutput);
+    closeStatEngine(&engine);
+}
 
-    // Handle special permissions: setuid, setgid, sticky bit
-    if (mode & S_ISUID) perms[3] = (perms[3] == 'x') ? 's' : 'S';
-    if (mode & S_ISGID) perms[6] = (perms[6] == 'x') ? 's' : 'S';
-    if (mode & S_ISVTX) perms[9] = (perms[9] == 'x') ? 't' : 'T';
+/* Incremental scans
+--index keeps what the last scan saw in a file: an indexHeader, an indexEntry per path, then
+the names. The children of a directory are contiguous and sorted by name, so a directory is
+compared with its old self in one merge, and only new, changed and deleted entries are printed.
+A directory whose inode, mtime and ctime are all unchanged holds the same names as before, so
+it is not read again and only its subdirectories are stat'ed on the way down. Rewriting a file
+in place leaves its directory alone; that shows up once something else changes beside it.
+*/
+#define INDEX_MAGIC "INSPIDX1"
+#define INDEX_DIRECTORY 1  // a real directory, not a link to one
+#define INDEX_WALKED 2     // its children were recorded
+
+typedef struct indexHeader {
+    char magic[8];
+    uint64_t numEntries;
+    uint64_t stringsSize;
+} indexHeader;
+
+typedef struct indexEntry {
+    uint64_t ino;
+    int64_t size;
+    int64_t mtimeSec, ctimeSec;
+    uint32_t mtimeNsec, ctimeNsec;
+    uint32_t mode;
+    uint16_t nameLen, flags;
+    uint32_t nameOff;
+    uint32_t firstChild, numChildren;
+} indexEntry;
+
+typedef struct indexScan {
+    // The last index, mapped read only
+    const indexEntry *oldEntries;
+    size_t oldCount;
+    const char *oldStrings;
+    void *map;
+    size_t mapSize;
+    // The one being built; entries are referred to by number as the array moves
+    indexEntry *entries;
+    size_t numEntries, capEntries;
+    outBuffer strings;
+    outBuffer *out, *log;
+    int recursive, readable, jsonOutput;
+} indexScan;
+
+// A missing or unusable index is an empty one, so everything comes out new
+static void loadIndex(indexScan *scan, const char *indexPath) {
+    int fd = open(indexPath, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Error opening index %s: %s\n", indexPath, strerror(errno));
+        }
+        return;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(indexHeader)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+
+    const indexHeader *header = map;
+    const indexEntry *entries = (const indexEntry *)(header + 1);
+    size_t room = st.st_size - sizeof(indexHeader);
+    int valid = memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0
+             && header->numEntries <= room / sizeof(indexEntry)
+             && header->stringsSize == room - header->numEntries * sizeof(indexEntry);
+    // Children always come after their parent, so walking the index always ends
+    for (uint64_t i = 0; valid && i < header->numEntries; i++) {
+        const indexEntry *e = &entries[i];
+        valid = (uint64_t)e->nameOff + e->nameLen <= header->stringsSize
+             && (!(e->flags & INDEX_WALKED)
+                 || (e->firstChild > i && (uint64_t)e->firstChild + e->numChildren <= header->numEntries));
+    }
+    if (!valid) {
+        fprintf(stderr, "Ignoring damaged index %s\n", indexPath);
+        munmap(map, st.st_size);
+        return;
+    }
+    scan->map = map;
+    scan->mapSize = st.st_size;
+    scan->oldEntries = entries;
+    scan->oldCount = header->numEntries;
+    scan->oldStrings = (const char *)(entries + header->numEntries);
+}
+
+// Writes the new index beside the old one and renames it over, so a failed run keeps the old
+static void saveIndex(indexScan *scan, const char *indexPath) {
+    char tmpPath[PATH_MAX];
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", indexPath) >= (int)sizeof(tmpPath)) {
+        fprintf(stderr, "Path too long: %s\n", indexPath);
+        return;
+    }
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error writing index %s: %s\n", tmpPath, strerror(errno));
+        return;
+    }
+    indexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.numEntries = scan->numEntries;
+    header.stringsSize = scan->strings.len;
+
+    outBuffer file;
+    outOpen(&file, fd);
+    outChars(&file, (const char *)&header, sizeof(header));
+    outChars(&file, (const char *)scan->entries, scan->numEntries * sizeof(indexEntry));
+    outChars(&file, scan->strings.data, scan->strings.len);
+    outClose(&file);
 
-    return perms;
+    // A short write leaves a file of the wrong size behind
+    struct stat st;
+    off_t expected = sizeof(header) + scan->numEntries * sizeof(indexEntry) + scan->strings.len;
+    int ok = fstat(fd, &st) == 0 && st.st_size == expected;
+    if (close(fd) != 0 || !ok || rename(tmpPath, indexPath) != 0) {
+        fprintf(stderr, "Error writing index %s\n", indexPath);
+        unlink(tmpPath);
+    }
+}
+
+static uint32_t addIndexEntry(indexScan *scan, const char *name, size_t len, const struct stat *fileInfo, int flags) {
+    if (scan->numEntries == scan->capEntries) {
+        scan->capEntries = scan->capEntries ? scan->capEntries * 2 : 1024;
+        scan->entries = realloc(scan->entries, scan->capEntries * sizeof(indexEntry));
+        if (scan->entries == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    indexEntry *e = &scan->entries[scan->numEntries];
+    memset(e, 0, sizeof(*e));
+    e->ino = fileInfo->st_ino;
+    e->size = fileInfo->st_size;
+    e->mtimeSec = fileInfo->st_mtim.tv_sec;
+    e->mtimeNsec = fileInfo->st_mtim.tv_nsec;
+    e->ctimeSec = fileInfo->st_ctim.tv_sec;
+    e->ctimeNsec = fileInfo->st_ctim.tv_nsec;
+    e->mode = fileInfo->st_mode;
+    e->flags = flags;
+    e->nameOff = scan->strings.len;
+    e->nameLen = len;
+    outChars(&scan->strings, name, len);
+    return scan->numEntries++;
 }
 
-void printFileInfo(const char *filePath, int showInode, int humanReadable, int jsonOutput) {
+// Copies an entry of an unchanged directory without its children
+static void copyIndexEntry(indexScan *scan, const indexEntry *old) {
     struct stat fileInfo;
-    if (stat(filePath, &fileInfo) != 0) {
-        perror("Failed to get file stats");
+    memset(&fileInfo, 0, sizeof(fileInfo));
+    fileInfo.st_ino = old->ino;
+    fileInfo.st_size = old->size;
+    fileInfo.st_mtim.tv_sec = old->mtimeSec;
+    fileInfo.st_mtim.tv_nsec = old->mtimeNsec;
+    fileInfo.st_ctim.tv_sec = old->ctimeSec;
+    fileInfo.st_ctim.tv_nsec = old->ctimeNsec;
+    fileInfo.st_mode = old->mode;
+    addIndexEntry(scan, scan->oldStrings + old->nameOff, old->nameLen, &fileInfo, old->flags & INDEX_DIRECTORY);
+}
+
+// Keeps what the last index held below a directory that is not walked this time
+static void copySubtree(indexScan *scan, uint32_t self, const indexEntry *old) {
+    uint32_t first = scan->numEntries;
+    for (uint32_t i = 0; i < old->numChildren; i++) {
+        copyIndexEntry(scan, &scan->oldEntries[old->firstChild + i]);
+    }
+    scan->entries[self].flags |= INDEX_WALKED;
+    scan->entries[self].firstChild = first;
+    scan->entries[self].numChildren = old->numChildren;
+    for (uint32_t i = 0; i < old->numChildren; i++) {
+        const indexEntry *child = &scan->oldEntries[old->firstChild + i];
+        if (child->flags & INDEX_WALKED) {
+            copySubtree(scan, first + i, child);
+        }
+    }
+}
+
+static int sameTimes(const indexEntry *a, const indexEntry *b) {
+    return a->ino == b->ino && a->mtimeSec == b->mtimeSec && a->mtimeNsec == b->mtimeNsec
+        && a->ctimeSec == b->ctimeSec && a->ctimeNsec == b->ctimeNsec;
+}
+
+static int sameEntry(const indexEntry *a, const indexEntry *b) {
+    return sameTimes(a, b) && a->size == b->size && a->mode == b->mode;
+}
+
+// Orders names the way strcmp does
+static int compareName(const char *a, size_t aLen, const char *b, size_t bLen) {
+    int cmp = memcmp(a, b, aLen < bLen ? aLen : bLen);
+    return cmp != 0 ? cmp : (aLen > bLen) - (aLen < bLen);
+}
+
+static int compareNames(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static void printDeletedTree(indexScan *scan, const indexEntry *old, char *filePath, size_t base, int withSelf) {
+    if (!joinPath(filePath, base, scan->oldStrings + old->nameOff, old->nameLen)) {
         return;
     }
-    if (jsonOutput) {
-        printJSONOutput(filePath, &fileInfo, humanReadable);
-    } else {
-        printTextOutput(filePath, &fileInfo, humanReadable); 
+    if (withSelf) {
+        printChange(scan->out, "deleted", filePath, NULL, scan->readable, scan->jsonOutput);
+    }
+    if (old->flags & INDEX_WALKED) {
+        char childPath[PATH_MAX];
+        size_t childBase = pathPrefix(childPath, filePath);
+        for (uint32_t i = 0; i < old->numChildren; i++) {
+            printDeletedTree(scan, &scan->oldEntries[old->firstChild + i], childPath, childBase, 1);
+        }
+    }
+}
+
+static int statIndexed(indexScan *scan, int dirFd, const char *name, const char *filePath, struct stat *fileInfo) {
+    if (scan->log != NULL) {
+        outString(scan->log, "Processing file: ");
+        outString(scan->log, filePath);
+        outChars(scan->log, "\n", 1);
     }
+    if (statEntry(dirFd, name, 0, fileInfo) != 0) {
+        perror("Failed to get file stats");
+        return -1;
+    }
+    return 0;
 }
 
-char *formatTime(time_t time, int readable) {
-    static char buffer[20];
-    if (readable) {
-        strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", localtime(&time));
-        return buffer;
-     } 
-    else {
-        sprintf(buffer, "%ld", (long)time);
-        return buffer;
+static void scanDirectory(indexScan *scan, int parentFd, const char *name, const char *dirPath, uint32_t self, const indexEntry *old);
+
+// Prints a child that differs from old, its entry in the last index, and goes on into it
+// when it is a directory. filePath holds its path, with its name from base on.
+static void scanChild(indexScan *scan, int dirFd, char *filePath, size_t base, uint32_t child, const indexEntry *old, struct stat *fileInfo) {
+    const indexEntry *oldDir = old != NULL && (old->flags & INDEX_WALKED) ? old : NULL;
+    int isDirectory = scan->entries[child].flags & INDEX_DIRECTORY;
+    if (old == NULL || !sameEntry(&scan->entries[child], old)) {
+        printChange(scan->out, old == NULL ? "new" : "changed", filePath, fileInfo, scan->readable, scan->jsonOutput);
+    }
+    if (isDirectory && scan->recursive) {
+        scanDirectory(scan, dirFd, filePath + base, filePath, child, oldDir);
+    } else if (isDirectory && oldDir != NULL) {
+        copySubtree(scan, child, oldDir);
+    } else if (oldDir != NULL) {
+        // What was below it went when it stopped being a directory
+        printDeletedTree(scan, oldDir, filePath, base, 0);
     }
 }
 
-char* getHumanReadableSize(off_t size) {
-    static char readableSize[20];
-    if (size < 1024) sprintf(readableSize, "%lldB", (long long)size);
-    else if (size < 1024 * 1024) sprintf(readableSize, "%.1fK", size / 1024.0);
-    else if (size < 1024 * 1024 * 1024) sprintf(readableSize, "%.1fM", size / (1024.0 * 1024));
-    else sprintf(readableSize, "%.1f G", size / (1024.0 * 1024 * 1024));
-    return readableSize;
+// Records the children of entry self, the directory name under parentFd whose path is
+// dirPath, printing what differs from old, its walked entry in the last index if any
+static void scanDirectory(indexScan *scan, int parentFd, const char *name, const char *dirPath, uint32_t self, const indexEntry *old) {
+    int fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = NULL;
+    if (fd < 0) {
+        fprintf(stderr, "Error opening directory %s: %s\n", dirPath, strerror(errno));
+        return;
+    }
+    char filePath[PATH_MAX];
+    size_t base = pathPrefix(filePath, dirPath);
+    const indexEntry *oldChildren = old != NULL ? &scan->oldEntries[old->firstChild] : NULL;
+    uint32_t numOld = old != NULL ? old->numChildren : 0;
+    uint32_t first = scan->numEntries;
+
+    // The stat of each child added, where it was stat'ed
+    struct stat *infos;
+    size_t room;
+    outBuffer names;
+    char **sorted = NULL;
+    outOpen(&names, -1);
+
+    if (old != NULL && sameTimes(&scan->entries[self], old)) {
+        // Same names as last time: keep the files, and stat only the directories to look below
+        room = numOld;
+        infos = malloc((room + 1) * sizeof(struct stat));
+        if (infos == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < numOld; i++) {
+            const indexEntry *o = &oldChildren[i];
+            size_t k = scan->numEntries - first;
+            if (!(o->flags & INDEX_DIRECTORY)) {
+                copyIndexEntry(scan, o);
+                continue;
+            }
+            if (!joinPath(filePath, base, scan->oldStrings + o->nameOff, o->nameLen)
+                || statIndexed(scan, fd, filePath + base, filePath, &infos[k]) != 0) {
+                continue;
+            }
+            addIndexEntry(scan, filePath + base, o->nameLen, &infos[k], S_ISDIR(infos[k].st_mode) ? INDEX_DIRECTORY : 0);
+        }
+    } else {
+        if ((dir = fdopendir(fd)) == NULL) {
+            fprintf(stderr, "Error opening directory %s: %s\n", dirPath, strerror(errno));
+            close(fd);
+            outClose(&names);
+            return;
+        }
+
+        // Every name is read first, as they have to be sorted to merge with the old children
+        struct dirent *entry;
+        room = 0;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            outChars(&names, (const char *)&entry->d_type, 1);
+            outChars(&names, entry->d_name, strlen(entry->d_name) + 1);
+            room++;
+        }
+        sorted = malloc((room + 1) * sizeof(char *));
+        infos = malloc((room + 1) * sizeof(struct stat));
+        if (sorted == NULL || infos == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = 0, pos = 0; i < room; i++) {
+            sorted[i] = names.data + pos + 1;
+            pos += strlen(sorted[i]) + 2;
+        }
+        qsort(sorted, room, sizeof(char *), compareNames);
+
+        for (size_t i = 0; i < room; i++) {
+            size_t len = strlen(sorted[i]);
+            size_t k = scan->numEntries - first;
+            if (!joinPath(filePath, base, sorted[i], len) || statIndexed(scan, fd, sorted[i], filePath, &infos[k]) != 0) {
+                continue;
+            }
+            // The type readdir gave is kept in the byte before the name
+            int walkable = isWalkable(fd, sorted[i], (unsigned char)sorted[i][-1], 1, &infos[k]);
+            addIndexEntry(scan, sorted[i], len, &infos[k], walkable ? INDEX_DIRECTORY : 0);
+        }
+    }
+
+    // The children are the block added so far; going further down adds after it. Merging
+    // it with the old children pairs them up and prints everything in name order.
+    uint32_t count = scan->numEntries - first;
+    scan->entries[self].flags |= INDEX_WALKED;
+    scan->entries[self].firstChild = first;
+    scan->entries[self].numChildren = count;
+    uint32_t j = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        const indexEntry *e = i < count ? &scan->entries[first + i] : NULL;
+        int cmp = 1;
+        while (j < numOld && (e == NULL || (cmp = compareName(scan->oldStrings + oldChildren[j].nameOff, oldChildren[j].nameLen, scan->strings.data + e->nameOff, e->nameLen)) < 0)) {
+            printDeletedTree(scan, &oldChildren[j++], filePath, base, 1);
+        }
+        if (e != NULL) {
+            const indexEntry *match = cmp == 0 ? &oldChildren[j++] : NULL;
+            joinPath(filePath, base, scan->strings.data + e->nameOff, e->nameLen);
+            scanChild(scan, fd, filePath, base, first + i, match, &infos[i]);
+        }
+    }
+
+    free(infos);
+    free(sorted);
+    outClose(&names);
+    if (dir != NULL) {
+        closedir(dir);
+    } else {
+        close(fd);
+    }
+}
+
+void listChanges(const char *dirPath, const char *indexPath, int recursive, int readable, int jsonOutput, FILE *logfp) {
+    indexScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.recursive = recursive;
+    scan.readable = readable;
+    scan.jsonOutput = jsonOutput;
+    loadIndex(&scan, indexPath);
+    outOpen(&scan.strings, -1);
+
+    struct stat fileInfo;
+    if (statEntry(AT_FDCWD, dirPath, 0, &fileInfo) != 0) {
+        fprintf(stderr, "Error opening directory %s: %s\n", dirPath, strerror(errno));
+    } else {
+        outBuffer out, log;
+        beginListing(&out, &log, logfp, jsonOutput);
+        scan.out = &out;
+        scan.log = logfp != NULL ? &log : NULL;
+
+        // The root entry is named by the path it was scanned from; another path starts afresh
+        const indexEntry *old = NULL;
+        size_t len = strlen(dirPath);
+        if (scan.oldCount > 0 && (scan.oldEntries[0].flags & INDEX_WALKED)
+            && compareName(scan.oldStrings + scan.oldEntries[0].nameOff, scan.oldEntries[0].nameLen, dirPath, len) == 0) {
+            old = &scan.oldEntries[0];
+        }
+        if (len > UINT16_MAX) {
+            fprintf(stderr, "Path too long: %s\n", dirPath);
+        } else {
+            addIndexEntry(&scan, dirPath, len, &fileInfo, INDEX_DIRECTORY);
+            scanDirectory(&scan, AT_FDCWD, dirPath, dirPath, 0, old);
+        }
+        endListing(&out, &log, logfp, jsonOutput);
+        if (scan.numEntries > 0) {
+            saveIndex(&scan, indexPath);
+        }
+    }
+
+    if (scan.map != NULL) {
+        munmap(scan.map, scan.mapSize);
+    }
+    free(scan.entries);
+    outClose(&scan.strings);
+}
+
+/* Parallel walk
+Every directory is a task. Its listing is written to a memory buffer of its own, with a mark
+wherever the single threaded walk would have descended into a subdirectory, and each
+subdirectory becomes a new task. Workers keep their own queue, take the newest task from it
+and steal the oldest one from another worker when it runs dry, so a thief tends to get a big
+subtree. Unordered, a worker reuses one buffer for all its directories and copies each into
+the stdout buffer whole as soon as it is done. Ordered, every directory keeps a buffer of its
+own and the main thread prints them depth first through the marks, which gives exactly the
+serial output.
+*/
+typedef struct dirTask dirTask;
+
+// Everything below a directory, not counting the directory itself
+typedef struct dirTotals {
+    long long bytes;
+    long entries;
+    long regular, directories, links, other;
+    int maxDepth;
+    time_t oldest, newest;
+} dirTotals;
+
+typedef struct topEntry {
+    char *path;
+    dirTotals totals;
+} topEntry;
+
+typedef struct dirChild {
+    size_t outEnd;
+    size_t logEnd;
+    dirTask *task;
+} dirChild;
+
+struct dirTask {
+    char *path;
+    outBuffer out, log;
+    dirChild *children;
+    size_t numChildren, capChildren;
+    int done;
+    // Summaries add each directory into its parent once nothing below it is left to do
+    dirTask *parent;
+    long remaining;
+    dirTotals totals;
+    DIR *dir;            // the summary's cursor while the directory is being read
+    dirTotals own;       // what the directory holds itself, added in when it is read
+};
+
+typedef struct workQueue {
+    pthread_mutex_t lock;
+    dirTask **tasks;
+    size_t head, tail, cap;
+} workQueue;
+
+typedef struct walkPool {
+    workQueue *queues;
+    int numWorkers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t finished;
+    long queued;
+    long pending;
+    long idle;           // workers waiting for a task
+    int showInode, recursive, readable, jsonOutput, ordered;
+    pthread_mutex_t outputLock;
+    outBuffer *out, *log;
+    pthread_t *threads;
+    struct walkWorker *workerArgs;
+    // Summaries: the largest directories so far, as a heap with the smallest on top
+    int summary;
+    pthread_mutex_t summaryLock;
+    topEntry *top;
+    int topCount, topCap, topMax;
+} walkPool;
+
+typedef struct walkWorker {
+    walkPool *pool;
+    int id;
+    outBuffer out, log;
+} walkWorker;
+
+static dirTask *newDirTask(const char *path) {
+    dirTask *task = calloc(1, sizeof(dirTask));
+    if (task == NULL || (task->path = strdup(path)) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    outOpen(&task->out, -1);
+    outOpen(&task->log, -1);
+    return task;
+}
+
+static void freeDirTask(dirTask *task) {
+    free(task->path);
+    outClose(&task->out);
+    outClose(&task->log);
+    free(task->children);
+    free(task);
+}
+
+// The owner pushes and pops at the tail
+static void pushTask(workQueue *q, dirTask *task) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        if (q->head > 0) {
+            memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof(dirTask *));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            q->cap = q->cap ? q->cap * 2 : 64;
+            q->tasks = realloc(q->tasks, q->cap * sizeof(dirTask *));
+            if (q->tasks == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+    }
+    q->tasks[q->tail++] = task;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Newest task for the owner, oldest for a thief
+static dirTask *takeTask(workQueue *q, int steal) {
+    dirTask *task = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        task = steal ? q->tasks[q->head++] : q->tasks[--q->tail];
+        if (q->head == q->tail) {
+            q->head = q->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return task;
+}
+
+static void submitTask(walkPool *pool, int id, dirTask *task) {
+    pushTask(&pool->queues[id], task);
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void taskDone(walkPool *pool, dirTask *task) {
+    pthread_mutex_lock(&pool->lock);
+    task->done = 1;
+    if (--pool->pending == 0) {
+        pthread_cond_broadcast(&pool->wake);
+    }
+    pthread_cond_broadcast(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Copies bytes start to end of a finished buffer into to
+static void writeBuffer(outBuffer *to, const outBuffer *from, size_t start, size_t end) {
+    if (end > start) {
+        outChars(to, from->data + start, end - start);
+    }
+}
+
+// Lists one directory into the task's or the worker's buffers, queueing its subdirectories
+static void walkDirectory(walkPool *pool, walkWorker *worker, dirTask *task) {
+    outBuffer *out = pool->ordered ? &task->out : &worker->out;
+    outBuffer *log = pool->log == NULL ? NULL : pool->ordered ? &task->log : &worker->log;
+    DIR *dir = opendir(task->path);
+    struct dirent *entry;
+
+    if (dir == NULL) {
+        fprintf(stderr, "Error opening directory %s: %s\n", task->path, strerror(errno));
+    }
+    char filePath[PATH_MAX];
+    size_t base = pathPrefix(filePath, task->path);
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        if (printEntry(out, log, dirfd(dir), entry, filePath, base, pool->readable, pool->jsonOutput) && pool->recursive) {
+            if (!pool->jsonOutput) {
+                outChars(out, "\n", 1);
+            }
+            if (task->numChildren == task->capChildren) {
+                task->capChildren = task->capChildren ? task->capChildren * 2 : 8;
+                task->children = realloc(task->children, task->capChildren * sizeof(dirChild));
+                if (task->children == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            dirChild *child = &task->children[task->numChildren++];
+            child->outEnd = out->len;
+            child->logEnd = log != NULL ? log->len : 0;
+            child->task = newDirTask(filePath);
+            submitTask(pool, worker->id, child->task);
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+
+    if (!pool->ordered) {
+        pthread_mutex_lock(&pool->outputLock);
+        writeBuffer(pool->out, out, 0, out->len);
+        if (log != NULL) {
+            writeBuffer(pool->log, log, 0, log->len);
+        }
+        pthread_mutex_unlock(&pool->outputLock);
+        out->len = 0;
+        if (log != NULL) {
+            log->len = 0;
+        }
+    }
+
+    taskDone(pool, task);
+
+    // Unordered, nothing looks at a task once it is printed
+    if (!pool->ordered) {
+        freeDirTask(task);
+    }
+}
+
+/* Summaries
+A summary walk goes depth first through each task it takes, keeping every directory on its path
+open as a cursor, and gives a subdirectory to the queues only when a worker is idle and nothing
+is queued for it; otherwise it descends into it there and then. Leaves always stay with the
+walk that finds them. Each directory counts itself and its unfinished subdirectories as
+remaining work. When that count reaches zero its totals are final: it is offered
+to the top list, added into its parent and freed. Nothing is kept per file, and what is pending
+is a path's worth of directories for each task given out, O(depth * workers) however wide the tree.
+Entries are stat'ed with statEntry, so they go through statx for just the printed fields.
+*/
+static void addTotals(dirTotals *to, const dirTotals *from, int depth) {
+    if (from->entries > 0) {
+        if (to->entries == 0 || from->oldest < to->oldest) {
+            to->oldest = from->oldest;
+        }
+        if (to->entries == 0 || from->newest > to->newest) {
+            to->newest = from->newest;
+        }
+    }
+    to->bytes += from->bytes;
+    to->entries += from->entries;
+    to->regular += from->regular;
+    to->directories += from->directories;
+    to->links += from->links;
+    to->other += from->other;
+    if (from->maxDepth + depth > to->maxDepth) {
+        to->maxDepth = from->maxDepth + depth;
+    }
+}
+
+static int topSmaller(const topEntry *a, const topEntry *b) {
+    return a->totals.bytes < b->totals.bytes;
+}
+
+// Takes over the task's path when the directory makes the list
+static void offerTop(walkPool *pool, dirTask *task) {
+    topEntry entry = {task->path, task->totals};
+    int i;
+    if (pool->topCount < pool->topMax) {
+        if (pool->topCount == pool->topCap) {
+            pool->topCap = pool->topCap ? pool->topCap * 2 : 64;
+            pool->top = realloc(pool->top, pool->topCap * sizeof(topEntry));
+            if (pool->top == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        // Sift up from the new leaf
+        i = pool->topCount++;
+        while (i > 0 && topSmaller(&entry, &pool->top[(i - 1) / 2])) {
+            pool->top[i] = pool->top[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else if (topSmaller(&pool->top[0], &entry)) {
+        // Sift down from the root the smallest is leaving
+        free(pool->top[0].path);
+        i = 0;
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= pool->topCount) {
+                break;
+            }
+            if (child + 1 < pool->topCount && topSmaller(&pool->top[child + 1], &pool->top[child])) {
+                child++;
+            }
+            if (!topSmaller(&pool->top[child], &entry)) {
+                break;
+            }
+            pool->top[i] = pool->top[child];
+            i = child;
+        }
+    } else {
+        return;
+    }
+    pool->top[i] = entry;
+    task->path = NULL;
+}
+
+// Adds what the task read itself, then finishes it and every parent it was the last piece of
+static void finishSummary(walkPool *pool, dirTask *task, const dirTotals *own) {
+    pthread_mutex_lock(&pool->summaryLock);
+    addTotals(&task->totals, own, 0);
+    while (task != NULL && --task->remaining == 0) {
+        dirTask *parent = task->parent;
+        offerTop(pool, task);
+        if (parent != NULL) {
+            addTotals(&parent->totals, &task->totals, 1);
+        }
+        freeDirTask(task);
+        task = parent;
+    }
+    pthread_mutex_unlock(&pool->summaryLock);
+}
+
+// Opens a summary directory relative to parentFd, which is AT_FDCWD for a task from the queues
+static void openSummary(dirTask *task, int parentFd, const char *name) {
+    int fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0 && (task->dir = fdopendir(fd)) == NULL) {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    if (task->dir == NULL) {
+        fprintf(stderr, "Error opening directory %s: %s\n", task->path, strerror(errno));
+    }
+}
+
+// Whether a subdirectory should go to the queues instead of being walked in place
+static int workerIdle(walkPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    int idle = pool->idle > pool->queued;
+    pthread_mutex_unlock(&pool->lock);
+    return idle;
+}
+
+// Totals up the tree below a task depth first, the directory being read on top and its parents
+// below it through their parent links. Links are counted, not followed.
+static void summarizeDirectory(walkPool *pool, walkWorker *worker, dirTask *task) {
+    dirTask *top = task;
+    char filePath[PATH_MAX];
+    openSummary(task, AT_FDCWD, task->path);
+
+    while (top != NULL) {
+        struct dirent *entry = top->dir != NULL ? readdir(top->dir) : NULL;
+        if (entry == NULL) {
+            // Finishing the summary may free the directory, and the task's parent is not ours
+            dirTask *parent = top == task ? NULL : top->parent;
+            if (top->dir != NULL) {
+                closedir(top->dir);
+                top->dir = NULL;
+            }
+            if (top == task) {
+                taskDone(pool, task);
+            }
+            finishSummary(pool, top, &top->own);
+            top = parent;
+            continue;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        struct stat fileInfo;
+        if (statEntry(dirfd(top->dir), entry->d_name, AT_SYMLINK_NOFOLLOW, &fileInfo) != 0) {
+            perror("Failed to get file stats");
+            continue;
+        }
+        dirTotals *own = &top->own;
+        if (own->entries == 0 || fileInfo.st_mtime < own->oldest) {
+            own->oldest = fileInfo.st_mtime;
+        }
+        if (own->entries == 0 || fileInfo.st_mtime > own->newest) {
+            own->newest = fileInfo.st_mtime;
+        }
+        own->bytes += fileInfo.st_size;
+        own->entries++;
+        own->maxDepth = 1;
+        if (S_ISREG(fileInfo.st_mode)) {
+            own->regular++;
+        } else if (S_ISLNK(fileInfo.st_mode)) {
+            own->links++;
+        } else if (!S_ISDIR(fileInfo.st_mode)) {
+            own->other++;
+        } else {
+            own->directories++;
+            size_t base = pathPrefix(filePath, top->path);
+            if (!joinPath(filePath, base, entry->d_name, strlen(entry->d_name))) {
+                continue;
+            }
+            dirTask *child = newDirTask(filePath);
+            child->parent = top;
+            child->remaining = 1;
+            pthread_mutex_lock(&pool->summaryLock);
+            top->remaining++;
+            pthread_mutex_unlock(&pool->summaryLock);
+            // A link count of 2 means no subdirectories on most filesystems, and a leaf is
+            // not worth the handover
+            if (fileInfo.st_nlink != 2 && workerIdle(pool)) {
+                submitTask(pool, worker->id, child);
+            } else {
+                openSummary(child, dirfd(top->dir), entry->d_name);
+                top = child;
+            }
+        }
+    }
+}
+
+static void *walkWorkerMain(void *arg) {
+    walkWorker *worker = (walkWorker *)arg;
+    walkPool *pool = worker->pool;
+
+    for (;;) {
+        dirTask *task = takeTask(&pool->queues[worker->id], 0);
+        for (int i = 1; task == NULL && i < pool->numWorkers; i++) {
+            task = takeTask(&pool->queues[(worker->id + i) % pool->numWorkers], 1);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (task != NULL) {
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            if (pool->summary) {
+                summarizeDirectory(pool, worker, task);
+            } else {
+                walkDirectory(pool, worker, task);
+            }
+            continue;
+        }
+        pool->idle++;
+        while (pool->pending > 0 && pool->queued <= 0) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        pool->idle--;
+        int finished = pool->pending == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (finished) {
+            return NULL;
+        }
+    }
+}
+
+// Prints a finished directory up to each mark, then the subdirectory behind it
+static void emitOrdered(walkPool *pool, dirTask *task) {
+    pthread_mutex_lock(&pool->lock);
+    while (!task->done) {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    size_t outPos = 0, logPos = 0;
+    for (size_t i = 0; i < task->numChildren; i++) {
+        dirChild *child = &task->children[i];
+        writeBuffer(pool->out, &task->out, outPos, child->outEnd);
+        outPos = child->outEnd;
+        if (pool->log != NULL) {
+            writeBuffer(pool->log, &task->log, logPos, child->logEnd);
+            logPos = child->logEnd;
+        }
+        emitOrdered(pool, child->task);
+    }
+    writeBuffer(pool->out, &task->out, outPos, task->out.len);
+    if (pool->log != NULL) {
+        writeBuffer(pool->log, &task->log, logPos, task->log.len);
+    }
+    freeDirTask(task);
+}
+
+// Starts the workers on the tree below root; the caller has set the pool's options
+static void startWalk(walkPool *pool, int workers, dirTask *root) {
+    pool->numWorkers = workers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->outputLock, NULL);
+    pthread_mutex_init(&pool->summaryLock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    pool->queues = calloc(workers, sizeof(workQueue));
+    pool->threads = calloc(workers, sizeof(pthread_t));
+    pool->workerArgs = calloc(workers, sizeof(walkWorker));
+    if (pool->queues == NULL || pool->threads == NULL || pool->workerArgs == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        outOpen(&pool->workerArgs[i].out, -1);
+        outOpen(&pool->workerArgs[i].log, -1);
+    }
+    submitTask(pool, 0, root);
+
+    for (int i = 0; i < workers; i++) {
+        pool->workerArgs[i].pool = pool;
+        pool->workerArgs[i].id = i;
+        if (pthread_create(&pool->threads[i], NULL, walkWorkerMain, &pool->workerArgs[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+}
+
+// Waits for the workers to run out of tasks
+static void finishWalk(walkPool *pool) {
+    for (int i = 0; i < pool->numWorkers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (int i = 0; i < pool->numWorkers; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].tasks);
+        outClose(&pool->workerArgs[i].out);
+        outClose(&pool->workerArgs[i].log);
+    }
+    free(pool->queues);
+    free(pool->threads);
+    free(pool->workerArgs);
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->summaryLock);
+    pthread_mutex_destroy(&pool->outputLock);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+void listFilesParallel(const char *dirPath, int showInode, int recursive, int readable, int jsonOutput, FILE *logfp, int workers, int ordered) {
+    walkPool pool = {0};
+    pool.showInode = showInode;
+    pool.recursive = recursive;
+    pool.readable = readable;
+    pool.jsonOutput = jsonOutput;
+    pool.ordered = ordered;
+
+    outBuffer out, log;
+    beginListing(&out, &log, logfp, jsonOutput);
+    pool.out = &out;
+    pool.log = logfp != NULL ? &log : NULL;
+    dirTask *root = newDirTask(dirPath);
+    startWalk(&pool, workers, root);
+    if (ordered) {
+        emitOrdered(&pool, root);
+    }
+    finishWalk(&pool);
+    endListing(&out, &log, logfp, jsonOutput);
+}
+
+// Largest first
+static int compareTop(const void *a, const void *b) {
+    const topEntry *x = a, *y = b;
+    if (x->totals.bytes != y->totals.bytes) {
+        return x->totals.bytes < y->totals.bytes ? 1 : -1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static void printSummary(outBuffer *out, const topEntry *e, int readable, int jsonOutput) {
+    const dirTotals *t = &e->totals;
+    if (jsonOutput) {
+        outString(out, ",\n{\n  \"directory\": \"");
+        outJSONString(out, e->path);
+        outString(out, "\",\n  \"bytes\": ");
+        outNumber(out, t->bytes);
+        outString(out, ",\n  \"entries\": ");
+        outNumber(out, t->entries);
+        outString(out, ",\n  \"types\": {\n    \"regularFiles\": ");
+        outNumber(out, t->regular);
+        outString(out, ",\n    \"directories\": ");
+        outNumber(out, t->directories);
+        outString(out, ",\n    \"symbolicLinks\": ");
+        outNumber(out, t->links);
+        outString(out, ",\n    \"other\": ");
+        outNumber(out, t->other);
+        outString(out, "\n  },\n  \"maxDepth\": ");
+        outNumber(out, t->maxDepth);
+        if (t->entries > 0) {
+            outString(out, ",\n  \"oldestModificationTime\": \"");
+            outTime(out, t->oldest, readable);
+            outString(out, "\",\n  \"newestModificationTime\": \"");
+            outTime(out, t->newest, readable);
+            outChars(out, "\"", 1);
+        }
+        outString(out, "\n}");
+        return;
+    }
+
+    outString(out, "Directory: ");
+    outString(out, e->path);
+    outString(out, "\n  Size: ");
+    if (readable == 1) {
+        outSize(out, t->bytes);
+    } else {
+        outNumber(out, t->bytes);
+        outString(out, " bytes");
+    }
+    outString(out, "\n  Entries: ");
+    outNumber(out, t->entries);
+    outString(out, "\n  Regular Files: ");
+    outNumber(out, t->regular);
+    outString(out, "\n  Directories: ");
+    outNumber(out, t->directories);
+    outString(out, "\n  Symbolic Links: ");
+    outNumber(out, t->links);
+    outString(out, "\n  Other: ");
+    outNumber(out, t->other);
+    outString(out, "\n  Max Depth: ");
+    outNumber(out, t->maxDepth);
+    if (t->entries > 0) {
+        outString(out, "\n  Oldest Modification Time: ");
+        outTime(out, t->oldest, readable);
+        outString(out, "\n  Newest Modification Time: ");
+        outTime(out, t->newest, readable);
+    }
+    outChars(out, "\n", 1);
+}
+
+void summarizeTree(const char *dirPath, int readable, int jsonOutput, int workers, int topCount) {
+    walkPool pool = {0};
+    pool.summary = 1;
+    pool.topMax = topCount;
+
+    dirTask *root = newDirTask(dirPath);
+    root->remaining = 1;
+    startWalk(&pool, workers, root);
+    finishWalk(&pool);
+
+    qsort(pool.top, pool.topCount, sizeof(topEntry), compareTop);
+    outBuffer out, log;
+    beginListing(&out, &log, NULL, jsonOutput);
+    for (int i = 0; i < pool.topCount; i++) {
+        printSummary(&out, &pool.top[i], readable, jsonOutput);
+        free(pool.top[i].path);
+    }
+    endListing(&out, &log, NULL, jsonOutput);
+    free(pool.top);
+}
+
+
+/* Owner and group names
+Looking a name up can mean a round trip to LDAP or the like, so each id is resolved once for
+the whole process and kept in an open addressed table. Hits only take the read lock. A miss
+takes the write lock and looks again before resolving, so two threads never resolve the same
+id, and the names are never freed, so a returned name stays valid after the lock is dropped.
+Ids without a name are printed as numbers, as ls does.
+*/
+typedef struct idName {
+    unsigned int id;
+    char *name;          // NULL for an empty slot
+} idName;
+
+typedef struct idCache {
+    pthread_rwlock_t lock;
+    idName *slots;
+    size_t cap, count;
+    int groups;
+} idCache;
+
+static idCache userNames = {PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, 0};
+static idCache groupNames = {PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, 1};
+
+static idName *findId(idCache *cache, unsigned int id) {
+    if (cache->cap == 0) {
+        return NULL;
+    }
+    size_t i = (id * 0x9E3779B1u) & (cache->cap - 1);
+    while (cache->slots[i].name != NULL && cache->slots[i].id != id) {
+        i = (i + 1) & (cache->cap - 1);
+    }
+    return &cache->slots[i];
+}
+
+// getpwuid_r and getgrgid_r say how much room they need only by failing with ERANGE
+static char *resolveId(unsigned int id, int groups) {
+    size_t size = 1024;
+    char *buf = NULL, *name = NULL;
+    for (;;) {
+        char *bigger = realloc(buf, size);
+        if (bigger == NULL) {
+            break;
+        }
+        buf = bigger;
+        int err;
+        if (groups) {
+            struct group grp, *result = NULL;
+            err = getgrgid_r(id, &grp, buf, size, &result);
+            if (err == 0 && result != NULL) {
+                name = strdup(grp.gr_name);
+            }
+        } else {
+            struct passwd pwd, *result = NULL;
+            err = getpwuid_r(id, &pwd, buf, size, &result);
+            if (err == 0 && result != NULL) {
+                name = strdup(pwd.pw_name);
+            }
+        }
+        if (err != ERANGE) {
+            break;
+        }
+        size *= 2;
+    }
+    free(buf);
+    if (name == NULL) {
+        char digits[16];
+        snprintf(digits, sizeof(digits), "%u", id);
+        name = strdup(digits);
+    }
+    if (name == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    return name;
+}
+
+static const char *lookupId(idCache *cache, unsigned int id) {
+    pthread_rwlock_rdlock(&cache->lock);
+    idName *slot = findId(cache, id);
+    const char *name = slot != NULL ? slot->name : NULL;
+    pthread_rwlock_unlock(&cache->lock);
+    if (name != NULL) {
+        return name;
+    }
+
+    pthread_rwlock_wrlock(&cache->lock);
+    slot = findId(cache, id);
+    if (slot == NULL || slot->name == NULL) {
+        // Kept at most half full
+        if ((cache->count + 1) * 2 > cache->cap) {
+            size_t cap = cache->cap ? cache->cap * 2 : 64;
+            idName *slots = calloc(cap, sizeof(idName));
+            if (slots == NULL) {
+                perror("calloc");
+                exit(1);
+            }
+            idName *old = cache->slots;
+            size_t oldCap = cache->cap;
+            cache->slots = slots;
+            cache->cap = cap;
+            for (size_t i = 0; i < oldCap; i++) {
+                if (old[i].name != NULL) {
+                    *findId(cache, old[i].id) = old[i];
+                }
+            }
+            free(old);
+        }
+        slot = findId(cache, id);
+        slot->id = id;
+        slot->name = resolveId(id, cache->groups);
+        cache->count++;
+    }
+    name = slot->name;
+    pthread_rwlock_unlock(&cache->lock);
+    return name;
+}
+
+const char *userName(uid_t uid) {
+    return lookupId(&userNames, uid);
+}
+
+const char *groupName(gid_t gid) {
+    return lookupId(&groupNames, gid);
+}
+
+static const char *typeName(mode_t mode) {
+    return S_ISDIR(mode) ? "directory" : (S_ISLNK(mode) ? "symbolic link" : "regular file");
+}
+
+// Prints a time with its nanoseconds when FIELD_NSEC is set
+static void outStamp(outBuffer *out, const struct timespec *ts, int readable) {
+    outTime(out, ts->tv_sec, readable);
+    if (printFields & FIELD_NSEC) {
+        char fraction[10];
+        long nsec = ts->tv_nsec;
+        fraction[0] = '.';
+        for (int i = 9; i > 0; i--) {
+            fraction[i] = '0' + nsec % 10;
+            nsec /= 10;
+        }
+        outChars(out, fraction, sizeof(fraction));
+    }
+}
+
+static void outDevice(outBuffer *out, dev_t dev) {
+    outNumber(out, major(dev));
+    outChars(out, ":", 1);
+    outNumber(out, minor(dev));
+}
+
+static void printJSONFields(outBuffer *out, const char *filePath, struct stat *fileInfo, int readable) {
+    outString(out, "  \"filePath\": \"");
+    outJSONString(out, filePath);
+    outString(out, "\",\n  \"inode\": {\n    \"number\": ");
+    outNumber(out, (long)fileInfo->st_ino);
+    outString(out, ",\n    \"type\": \"");
+    outString(out, typeName(fileInfo->st_mode));
+    outString(out, "\",\n    \"permissions\": \"");
+    outPermissions(out, fileInfo->st_mode);
+    outString(out, "\",\n    \"linkCount\": ");
+    outNumber(out, (long)fileInfo->st_nlink);
+    outString(out, ",\n    \"uid\": ");
+    outNumber(out, (int)fileInfo->st_uid);
+    outString(out, ",\n    \"gid\": ");
+    outNumber(out, (int)fileInfo->st_gid);
+    if (printFields & FIELD_NAMES) {
+        outString(out, ",\n    \"owner\": \"");
+        outJSONString(out, userName(fileInfo->st_uid));
+        outString(out, "\",\n    \"group\": \"");
+        outJSONString(out, groupName(fileInfo->st_gid));
+        outChars(out, "\"", 1);
+    }
+    outString(out, ",\n    \"size\": \"");
+    outSize(out, fileInfo->st_size);
+    outChars(out, "\"", 1);
+    if (printFields & FIELD_BLOCKS) {
+        outString(out, ",\n    \"blocks\": ");
+        outNumber(out, (long long)fileInfo->st_blocks);
+    }
+    if (printFields & FIELD_DEVICE) {
+        outString(out, ",\n    \"device\": \"");
+        outDevice(out, fileInfo->st_dev);
+        outChars(out, "\"", 1);
+    }
+    outString(out, ",\n    \"accessTime\": \"");
+    outStamp(out, &fileInfo->st_atim, readable);
+    outString(out, "\",\n    \"modificationTime\": \"");
+    outStamp(out, &fileInfo->st_mtim, readable);
+    outString(out, "\",\n    \"statusChangeTime\": \"");
+    outStamp(out, &fileInfo->st_ctim, readable);
+    outString(out, "\"\n  }\n");
+}
+
+void printJSONOutput(outBuffer *out, const char *filePath, struct stat *fileInfo, int readable) {
+    outString(out, "{\n");
+    printJSONFields(out, filePath, fileInfo, readable);
+    outChars(out, "}", 1);
+}
+
+void printTextOutput(outBuffer *out, const char *filePath, struct stat *fileInfo, int readable) {
+    outString(out, "File Path: ");
+    outString(out, filePath);
+    outString(out, "\n  Inode Number: ");
+    outNumber(out, (long)fileInfo->st_ino);
+    outString(out, "\n  Type: ");
+    outString(out, typeName(fileInfo->st_mode));
+    outString(out, "\n  Permissions: ");
+    outPermissions(out, fileInfo->st_mode);
+    outString(out, "\n  Link Count: ");
+    outNumber(out, (long)fileInfo->st_nlink);
+    outString(out, "\n  UID: ");
+    outNumber(out, (int)fileInfo->st_uid);
+    outString(out, "\n  GID: ");
+    outNumber(out, (int)fileInfo->st_gid);
+    if (printFields & FIELD_NAMES) {
+        outString(out, "\n  Owner: ");
+        outString(out, userName(fileInfo->st_uid));
+        outString(out, "\n  Group: ");
+        outString(out, groupName(fileInfo->st_gid));
+    }
+
+    outString(out, "\n  Size: ");
+    if (readable == 1) {
+        outSize(out, fileInfo->st_size);
+    } else {
+        outNumber(out, fileInfo->st_size);
+        outString(out, " bytes");
+    }
+    if (printFields & FIELD_BLOCKS) {
+        outString(out, "\n  Blocks: ");
+        outNumber(out, (long long)fileInfo->st_blocks);
+    }
+    if (printFields & FIELD_DEVICE) {
+        outString(out, "\n  Device: ");
+        outDevice(out, fileInfo->st_dev);
+    }
+
+    outString(out, "\n  Access Time: ");
+    outStamp(out, &fileInfo->st_atim, readable);
+    outString(out, "\n  Modification Time: ");
+    outStamp(out, &fileInfo->st_mtim, readable);
+    outString(out, "\n  Status Change Time: ");
+    outStamp(out, &fileInfo->st_ctim, readable);
+    outChars(out, "\n", 1);
+}
+
+void outPermissions(outBuffer *out, mode_t mode) {
+    char perms[10];
+    perms[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : '-';
+    perms[1] = (mode & S_IRUSR) ? 'r' : '-';
+    perms[2] = (mode & S_IWUSR) ? 'w' : '-';
+    perms[3] = (mode & S_IXUSR) ? 'x' : '-';
+    perms[4] = (mode & S_IRGRP) ? 'r' : '-';
+    perms[5] = (mode & S_IWGRP) ? 'w' : '-';
+    perms[6] = (mode & S_IXGRP) ? 'x' : '-';
+    perms[7] = (mode & S_IROTH) ? 'r' : '-';
+    perms[8] = (mode & S_IWOTH) ? 'w' : '-';
+    perms[9] = (mode & S_IXOTH) ? 'x' : '-';
+
+    // Handle special permissions: setuid, setgid, sticky bit
+    if (mode & S_ISUID) perms[3] = (perms[3] == 'x') ? 's' : 'S';
+    if (mode & S_ISGID) perms[6] = (perms[6] == 'x') ? 's' : 'S';
+    if (mode & S_ISVTX) perms[9] = (perms[9] == 'x') ? 't' : 'T';
+
+    outChars(out, perms, sizeof(perms));
+}
+
+#ifdef STATX_BASIC_STATS
+void statxToStat(const struct statx *stx, struct stat *fileInfo) {
+    memset(fileInfo, 0, sizeof(*fileInfo));
+    fileInfo->st_ino = stx->stx_ino;
+    fileInfo->st_mode = stx->stx_mode;
+    fileInfo->st_nlink = stx->stx_nlink;
+    fileInfo->st_uid = stx->stx_uid;
+    fileInfo->st_gid = stx->stx_gid;
+    fileInfo->st_size = stx->stx_size;
+    fileInfo->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    fileInfo->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    fileInfo->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    fileInfo->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    fileInfo->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    fileInfo->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    fileInfo->st_blocks = stx->stx_blocks;
+    fileInfo->st_blksize = stx->stx_blksize;
+    fileInfo->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    fileInfo->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+}
+
+// Blocks cost some filesystems extra work, so they are only asked for when printed
+unsigned int statxMask(void) {
+    return STATX_PRINTED | ((printFields & FIELD_BLOCKS) ? STATX_BLOCKS : 0);
+}
+#endif
+
+// Stats name relative to the open directory dirFd, or to the working
+// directory with AT_FDCWD. flags is 0 or AT_SYMLINK_NOFOLLOW, as for fstatat.
+// statx is only asked for the fields that get printed.
+int statEntry(int dirFd, const char *name, int flags, struct stat *fileInfo) {
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+    if (statx(dirFd, name, flags, statxMask(), &stx) == 0) {
+        statxToStat(&stx, fileInfo);
+        return 0;
+    }
+    // Kernels older than statx get the plain call
+    if (errno != ENOSYS) {
+        return -1;
+    }
+#endif
+    return fstatat(dirFd, name, fileInfo, flags);
+}
+
+void printFileInfo(outBuffer *out, const char *filePath, int showInode, int humanReadable, int jsonOutput) {
+    struct stat fileInfo;
+    if (statEntry(AT_FDCWD, filePath, 0, &fileInfo) != 0) {
+        perror("Failed to get file stats");
+        return;
+    }
+    printStat(out, filePath, &fileInfo, humanReadable, jsonOutput);
+}
+
+// Prints an entry found by an incremental scan; deleted ones come without fileInfo
+void printChange(outBuffer *out, const char *change, const char *filePath, struct stat *fileInfo, int readable, int jsonOutput) {
+    if (jsonOutput) {
+        outString(out, ",\n{\n  \"change\": \"");
+        outString(out, change);
+        outString(out, "\",\n");
+        if (fileInfo != NULL) {
+            printJSONFields(out, filePath, fileInfo, readable);
+        } else {
+            outString(out, "  \"filePath\": \"");
+            outJSONString(out, filePath);
+            outString(out, "\"\n");
+        }
+        outChars(out, "}", 1);
+    } else {
+        outString(out, "Change: ");
+        outString(out, change);
+        outChars(out, "\n", 1);
+        if (fileInfo != NULL) {
+            printTextOutput(out, filePath, fileInfo, readable);
+        } else {
+            outString(out, "File Path: ");
+            outString(out, filePath);
+            outChars(out, "\n", 1);
+        }
+    }
+}
+
+void printStat(outBuffer *out, const char *filePath, struct stat *fileInfo, int humanReadable, int jsonOutput) {
+    if (jsonOutput) {
+        printJSONOutput(out, filePath, fileInfo, humanReadable);
+    } else {
+        printTextOutput(out, filePath, fileInfo, humanReadable); 
+    }
+}
+
+void outOpen(outBuffer *ob, int fd) {
+    memset(ob, 0, sizeof(*ob));
+    ob->fd = fd;
+    ob->timeBase = 1;  // never a quarter hour, so the first outTime fills timeFields
+    if (fd >= 0) {
+        ob->cap = OUT_BUFFER_SIZE;
+        ob->data = malloc(ob->cap);
+        if (ob->data == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+}
+
+void outClose(outBuffer *ob) {
+    outFlush(ob);
+    free(ob->data);
+    ob->data = NULL;
+    ob->len = ob->cap = 0;
+}
+
+static void writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void outFlush(outBuffer *ob) {
+    if (ob->fd >= 0 && ob->len > 0) {
+        writeAll(ob->fd, ob->data, ob->len);
+        ob->len = 0;
+    }
+}
+
+void outChars(outBuffer *ob, const char *s, size_t len) {
+    if (ob->skip > 0) {
+        size_t n = len < ob->skip ? len : ob->skip;
+        s += n;
+        len -= n;
+        ob->skip -= n;
+    }
+    if (ob->cap - ob->len < len) {
+        if (ob->fd >= 0) {
+            // Anything as big as the whole buffer skips it
+            outFlush(ob);
+            if (len >= ob->cap) {
+                writeAll(ob->fd, s, len);
+                return;
+            }
+        } else {
+            size_t cap = ob->cap ? ob->cap : 4096;
+            while (cap - ob->len < len) {
+                cap *= 2;
+            }
+            ob->data = realloc(ob->data, cap);
+            if (ob->data == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            ob->cap = cap;
+        }
+    }
+    if (len > 0) {
+        memcpy(ob->data + ob->len, s, len);
+        ob->len += len;
+    }
+}
+
+void outString(outBuffer *ob, const char *s) {
+    outChars(ob, s, strlen(s));
+}
+
+// Quotes and backslashes are escaped, and control characters become \u00XX
+void outJSONString(outBuffer *ob, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    const char *run = s;
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        outChars(ob, run, s - run);
+        char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+        if (c == '"' || c == '\\') {
+            escape[1] = c;
+            outChars(ob, escape, 2);
+        } else {
+            outChars(ob, escape, 6);
+        }
+        run = s + 1;
+    }
+    outChars(ob, run, s - run);
+}
+
+void outNumber(outBuffer *ob, long long value) {
+    char digits[21];
+    char *p = digits + sizeof(digits);
+    unsigned long long v = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    outChars(ob, p, digits + sizeof(digits) - p);
+}
+
+static char *putTwoDigits(char *p, int value) {
+    p[0] = '0' + value / 10;
+    p[1] = '0' + value % 10;
+    return p + 2;
+}
+
+// Readable times are YYYY-MM-DD HH:MM:SS in local time. localtime_r takes the time zone
+// lock, so only the quarter hour goes through it; zone offsets and their changes fall on
+// quarter hours, and the minutes and seconds past one are plain arithmetic.
+void outTime(outBuffer *ob, time_t time, int readable) {
+    if (!readable) {
+        outNumber(ob, (long)time);
+        return;
+    }
+    time_t base = time - ((time % 900) + 900) % 900;
+    struct tm tm;
+    if (base != ob->timeBase) {
+        if (localtime_r(&base, &ob->timeFields) == NULL) {
+            outNumber(ob, (long)time);
+            return;
+        }
+        ob->timeBase = base;
+    }
+    tm = ob->timeFields;
+    int seconds = tm.tm_min * 60 + tm.tm_sec + (int)(time - base);
+    if (seconds < 3600) {
+        tm.tm_min = seconds / 60;
+        tm.tm_sec = seconds % 60;
+    } else if (localtime_r(&time, &tm) == NULL) {
+        // Only offsets with odd seconds, long gone from the zone database, land here
+        outNumber(ob, (long)time);
+        return;
+    }
+
+    outNumber(ob, tm.tm_year + 1900);
+    char fields[15];
+    char *p = fields;
+    *p++ = '-';
+    p = putTwoDigits(p, tm.tm_mon + 1);
+    *p++ = '-';
+    p = putTwoDigits(p, tm.tm_mday);
+    *p++ = ' ';
+    p = putTwoDigits(p, tm.tm_hour);
+    *p++ = ':';
+    p = putTwoDigits(p, tm.tm_min);
+    *p++ = ':';
+    p = putTwoDigits(p, tm.tm_sec);
+    outChars(ob, fields, p - fields);
+}
+
+// Sizes from a kilobyte up get one decimal, rounded the way printf("%.1f") rounds the
+// exact quotient: to nearest, ties to even
+void outSize(outBuffer *ob, off_t size) {
+    static const char *units[] = {"K", "M", " G"};
+    if (size < 1024) {
+        outNumber(ob, size);
+        outChars(ob, "B", 1);
+        return;
+    }
+    int unit = size < 1024 * 1024 ? 0 : size < 1024 * 1024 * 1024 ? 1 : 2;
+    int shift = 10 * (unit + 1);
+    unsigned long long scaled = (unsigned long long)size * 10;
+    unsigned long long tenths = scaled >> shift;
+    unsigned long long rest = scaled & ((1ULL << shift) - 1), half = 1ULL << (shift - 1);
+    if (rest > half || (rest == half && (tenths & 1))) {
+        tenths++;
+    }
+    outNumber(ob, (long long)(tenths / 10));
+    char decimal[2] = {'.', '0' + (char)(tenths % 10)};
+    outChars(ob, decimal, 2);
+    outString(ob, units[unit]);
 }
 
 void printUsage(const char *programName) {
@@ -262,6 +2459,13 @@ void printUsage(const char *programName) {
     printf("  -i, --inode         Display detailed inode information for the specified file.\n");
     printf("  -a, --all           Display inode information for all files within the specified directory.\n");
     printf("  -r, --recursive     Recursively list files and directories.\n");
+    printf("  -j, --jobs N        Walk directories with N worker threads.\n");
+    printf("  -o, --ordered       With --jobs or --queue-depth, print in the same order as a single threaded walk.\n");
+    printf("  -q, --queue-depth N Keep up to N stats in flight at once, through io_uring where there is one.\n");
+    printf("  -n, --names         Print owner and group names as well as their ids.\n");
+    printf("  -F, --fields LIST   Print more fields, from: names, blocks, device, nsec.\n");
+    printf("  -x, --index FILE    Print only what changed since the scan recorded in FILE, then update it.\n");
+    printf("  -s, --summary N     Total up every subtree and print the N largest directories.\n");
 }
 
 void printHumanReadableSize(off_t size) {